@@ -1 +1,10 @@
-#define crc_address 0x1FE4
+/*
+  Program CRC location
+
+  the CRC word goes right after the program image, rounded up to a whole word (where hexmerge
+  and avrboot -crc put it), the linker fills in the end of the image (.text + .data initial
+  values) so the address is right after one build - no need to rebuild once the size is known
+*/
+
+extern char __data_load_end[];
+#define crc_address ((((unsigned)__data_load_end) + 1) & ~1)
@@ -15,7 +15,7 @@ Fran Sabolich
 #include <stdlib.h>
 #include <string.h>
 
-// now using automatically generated CRC file
+// program CRC is checked at start up (crc_address comes from the linker)
 #include "autocrc.h"
 
 // choose if we want EEprom support - comes at expense of less space for application
@@ -23,6 +23,16 @@ Fran Sabolich
 // program start address
 //#define EE_SUPPORT
 
+// choose if we want pipelined flash writes (page is programmed while the next one comes in)
+//#define PIPE_SUPPORT
+
+// choose if we want RLE compressed flash writes (needs PIPE_SUPPORT)
+//#define RLE_SUPPORT
+
+// choose if we want flash CRCs (avrboot only writes pages that changed and verifies with CRCs),
+// without it avrboot writes every page and verifies by reading flash back
+//#define CRC_SUPPORT
+
 #ifdef EE_SUPPORT
 	#define PROGSTART 0x1800
 #else
@@ -40,9 +50,23 @@ Fran Sabolich
 #define CMD_WRITE_FLASH 0x0004
 #define CMD_WRITE_EE 0x0005
 #define CMD_RUN 0x0006
+#define CMD_CRC_FLASH 0x0007
+#define CMD_WRITE_FLASH_PIPE 0x0008
+#define CMD_WRITE_FLASH_RLE 0x0009
 #define CMD_OK 0x0100
 #define CMD_FAIL 0x0200
 
+// measure the baud rate of the first space from avrboot (19200 to 115200 at 16MHz)
+// SU_AUTOBAUD is set in the Makefile, su_autobaud() in misc.asm does the tries and bit time limits
+
+// choose if we want to go straight to the application after a brown-out or watchdog (crash) reset
+// the "restart" command leaves BOOT_MAGIC at the top of SRAM so its watchdog reset waits for avrboot
+// (the .init3 code and reset cause check are about 66 bytes, with SU_AUTOBAUD about 6 bytes of the
+// 1K boot section are left), an idle RxD goes to the application after the su_autobaud() tries
+// (98mS at 16MHz from cycle counts, 200mS without SU_AUTOBAUD)
+//#define FAST_BOOT
+#define BOOT_MAGIC 0xb007
+
 #define CMD_HEADSIZE 6
 #define CMD_MINSIZE 8
 
@@ -57,12 +81,53 @@ typedef struct {
 void su_init(void);
 int su_getchar(void);
 void su_putchar(unsigned char);
-unsigned su_waitpulse(unsigned start_count);
-void do_reboot(void);
+unsigned char su_autobaud(void);
+void do_reboot(void) __attribute__ ((noreturn));
 
 command_buffer cmd;
 
-// calc CRC for program (firmware)
+#ifdef FAST_BOOT
+// reset cause and restart marker, read before anything is pushed on the stack
+unsigned char reset_flags __attribute__ ((section (".noinit")));
+unsigned boot_magic __attribute__ ((section (".noinit")));
+
+void get_reset_cause(void) __attribute__ ((naked)) __attribute__ ((section (".init3")));
+void get_reset_cause(void)
+{
+	reset_flags = MCUCSR;
+	MCUCSR = 0;
+	boot_magic = *(volatile unsigned *)(RAMEND - 1);
+	*(volatile unsigned *)(RAMEND - 1) = 0;
+}
+#endif
+
+#ifdef PIPE_SUPPORT
+unsigned char spm_state;								// 0 = idle, 1 = erasing, 2 = writing
+unsigned spm_page;
+unsigned char pipe_seq;									// sequence of last CMD_WRITE_FLASH_PIPE (host uses 1..15)
+unsigned pipe_pages;									// pages written by CMD_WRITE_FLASH_PIPE
+#endif
+#ifdef RLE_SUPPORT
+unsigned char page_buf[SPM_PAGESIZE];
+#endif
+
+#ifdef CRC_SUPPORT
+// calc CRC for flash from address up to end (bootloader check and CMD_CRC_FLASH)
+// flash is read a word per loop (low byte first) - same result as the byte by byte CRC
+unsigned int calc_flash_crc(unsigned address, unsigned end)
+{
+	unsigned n, w, crc;
+	
+	crc = 0xffff;
+	for (n = address; n < end; n += 2) {
+		w = pgm_read_word(n);
+		crc = _crc_ccitt_update (crc, w & 0xff);
+		crc = _crc_ccitt_update (crc, w >> 8);
+	}
+	return(crc);
+}
+#else
+// calc CRC for program (bootloader) - a byte per loop is smaller code
 unsigned int calc_prog_crc(unsigned nbytes)
 {
 	unsigned n, crc;
@@ -73,6 +138,7 @@ unsigned int calc_prog_crc(unsigned nbytes)
 	}
 	return(crc);
 }
+#endif
 
 // calc ccitt CRC on buffer
 unsigned int calc_crc(unsigned char *buf, unsigned nbytes)
@@ -94,6 +160,58 @@ void su_putbuf(char *buf, unsigned nbytes)
 	for (x = 0; x < nbytes; x++) su_putchar(*buf++);
 }
 
+#ifdef PIPE_SUPPORT
+// advance background page programming - called between received characters
+void spm_poll(void)
+{
+	if (spm_state && !boot_spm_busy()) {
+		if (spm_state == 1) {
+			// erase done - write page from the temporary buffer
+			boot_page_write(spm_page);
+			spm_state = 2;
+		}
+		else {
+			// write done - application section readable again
+			boot_rww_enable();
+			spm_state = 0;
+		}
+	}
+}
+
+// wait for background page programming
+void spm_finish(void)
+{
+	while (spm_state) spm_poll();
+}
+#endif
+
+#ifdef RLE_SUPPORT
+// expand RLE data into a flash page, return number of bytes (page size if ok)
+// control byte n < 128: n + 1 bytes follow as is, n >= 128: next byte repeated n - 125 times
+unsigned rle_expand(unsigned char *dst, unsigned char *src, unsigned nbytes)
+{
+	unsigned char n, c, rep;
+	unsigned i;
+	unsigned char *end;
+
+	i = 0; c = 0; end = src + nbytes;
+	while (src < end) {
+		n = *src++;
+		rep = n & 0x80;
+		if (rep) {
+			n -= 125;
+			c = *src++;
+		}
+		else n++;
+		while (n--) {
+			if (i >= SPM_PAGESIZE) return(0);
+			dst[i++] = rep ? c : *src++;
+		}
+	}
+	return(i);
+}
+#endif
+
 // get bytes from software uart (with timeout)
 unsigned su_getbuf(char *buf, unsigned maxbytes)
 {
@@ -102,6 +220,9 @@ unsigned su_getbuf(char *buf, unsigned maxbytes)
 	
 	nb = 0;
 	while (nb < maxbytes) {
+		#ifdef PIPE_SUPPORT
+		spm_poll();
+		#endif
 		x = su_getchar();
 		if (x < 0) break;
 		*buf++ = x;
@@ -134,6 +255,26 @@ void program_flash_page(unsigned page, unsigned char *buf)
 	boot_rww_enable();
 }
 
+#ifdef PIPE_SUPPORT
+// start programming flash page, spm_poll() finishes it
+// the temporary buffer is filled before the erase so buf is free when this returns
+void program_flash_start(unsigned page, unsigned char *buf)
+{
+	unsigned i, w;
+
+	eeprom_busy_wait();
+	for (i=0; i<SPM_PAGESIZE; i+=2) {
+		w = *buf++;
+		w |= (*buf++) << 8;
+		boot_page_fill((unsigned long)(page + i), w);
+	}
+	// application section is RWW - we keep running while it erases
+	boot_page_erase(page);
+	spm_page = page;
+	spm_state = 1;
+}
+#endif
+
 // listen to master
 void be_slave(void)
 {
@@ -147,6 +288,9 @@ void be_slave(void)
 			z = *(unsigned *)(((char *)&cmd) + (x - 2));
 			if (z == y) {
 				// command packet with good CRC
+				#ifdef PIPE_SUPPORT
+				spm_finish();
+				#endif
 				y = 0;
 				switch ((unsigned char)cmd.command) {
 					case CMD_GET_SPM_PAGESIZE:
@@ -165,6 +309,38 @@ void be_slave(void)
 							}
 						}
 						break;
+					#ifdef CRC_SUPPORT
+					case CMD_CRC_FLASH:
+						// nbytes in the reply is 2 (old bootloaders echo the request)
+						*(unsigned *)cmd.buffer = calc_flash_crc(cmd.address, cmd.address + cmd.nbytes);
+						cmd.nbytes = y = 2;
+						break;
+					#endif
+					#ifdef RLE_SUPPORT
+					case CMD_WRITE_FLASH_RLE:
+						// expand the page and carry on as CMD_WRITE_FLASH_PIPE
+						cmd.nbytes = rle_expand(page_buf, cmd.buffer, cmd.nbytes);
+						memcpy(cmd.buffer, page_buf, SPM_PAGESIZE);
+						// fall through
+					#endif
+					#ifdef PIPE_SUPPORT
+					case CMD_WRITE_FLASH_PIPE:
+						// sequence in bits 12-15, a repeated one (lost reply) is only answered again
+						x = cmd.command >> 12;
+						if (x != pipe_seq) {
+							pipe_seq = x;
+							if (cmd.nbytes == SPM_PAGESIZE) {
+								if (cmd.address <= ((unsigned)PROGSTART - (unsigned)SPM_PAGESIZE)) {
+									program_flash_start(cmd.address, cmd.buffer);
+									pipe_pages++;
+								}
+							}
+						}
+						// reply is the number of pages written so far (nbytes 2 like CMD_CRC_FLASH)
+						*(unsigned *)cmd.buffer = pipe_pages;
+						cmd.nbytes = y = 2;
+						break;
+					#endif
 					case CMD_RUN:
 						return;
 					#ifdef EE_SUPPORT	
@@ -173,7 +349,12 @@ void be_slave(void)
 						eeprom_read_block(cmd.buffer, (void *)cmd.address, y);
 						break;
 					case CMD_WRITE_EE:
-						eeprom_write_block(cmd.buffer, (void *)cmd.address, cmd.nbytes);
+						// only bytes that changed are written (3.4mS and one erase/write cycle each)
+						for (x = 0; x < cmd.nbytes; x++) {
+							if (eeprom_read_byte((uint8_t *)(cmd.address + x)) != cmd.buffer[x]) {
+								eeprom_write_byte((uint8_t *)(cmd.address + x), cmd.buffer[x]);
+							}
+						}
 						break;
 					#endif
 				}
@@ -190,20 +371,36 @@ void be_slave(void)
 int main(void)
 {
 	unsigned char lp, rv;
-	char str[32];
+	// "MON" (up to 31 characters) goes in the command buffer, a stack frame costs 30 bytes of code
+	char *str = (char *)cmd.buffer;
 		
+#ifdef FAST_BOOT
+	// power on and reset button get the full handshake window
+	if (!(reset_flags & (1 << PORF))) {
+		if (reset_flags & (1 << BORF)) do_reboot();
+		if ((reset_flags & (1 << WDRF)) && (boot_magic != BOOT_MAGIC)) do_reboot();
+	}
+#endif
+
 #ifdef crc_address
-	unsigned crc1, crc2;
-	
-	crc1 = pgm_read_word(crc_address);		// read program CRC
-	crc2 = calc_prog_crc(crc_address);		// read program CRC
-	if (crc1 != crc2) {
+	// the CRC of the program followed by its CRC word is 0 - smaller than reading the word
+	// and comparing, which pays for rounding crc_address up to a word
+#ifdef CRC_SUPPORT
+	if (calc_flash_crc(PROGSTART, crc_address + 2)) {
+#else
+	if (calc_prog_crc(crc_address + 2)) {
+#endif
 		// program CRC error
 		do_reboot();						// attempt to start application code
 	}
 #endif
 	su_init();
-	lp = 0; rv = 1;
+	rv = 1;
+#ifdef SU_AUTOBAUD
+	lp = su_autobaud();						// 20 if no pulse - don't wait for a space
+#else
+	lp = 0;
+#endif
 	while (lp++ < 20) {
 		if (su_getchar() == ' ') {
 			// got space character - probably bootloader
@@ -216,7 +413,7 @@ int main(void)
 		su_getchar(); su_getchar();
 		// wait for "MON" command
 		for (lp = 0; lp < 20; lp++) {
-			rv = su_getbuf(str, sizeof(str) - 1);
+			rv = su_getbuf(str, 31);
 			if (rv > 0) {
 				str[rv] = 0;
 				if (!strcmp("MON\r\n", str)) break;
@@ -0,0 +1,448 @@
+/*
+  AVR boot loader emulator (Linux)
+
+  opens a pseudo terminal and answers like bootload/ or bootload168/ on an AVR
+  (in memory flash and EEprom), so avrboot can be tested and timed without a board
+*/
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <fcntl.h>
+
+#include "libavrboot.h"
+
+#define BOOT_OSCCAL "OSCCAL=0\r\n"
+#define BOOT_OK "OK\r\n"
+#define AUTOBAUD_TIME 100000							// uS the bootloader waits for a space
+#define MON_TRIES 20
+
+// device profile (what the bootloader was built with)
+typedef struct {
+	char *name;
+	int page_size;										// SPM_PAGESIZE
+	int progstart;										// bootloader start (PROGSTART)
+	int ee_size;
+	int ee_support;
+	int crc_support;
+	int pipe_support;
+	int rle_support;
+	long spm_us;										// page erase and page write (each)
+	long ee_us;											// one EEprom byte
+} avr_profile;
+
+avr_profile profiles[] = {
+	{ "m8", 64, 0x1c00, 512, 0, 0, 0, 0, 4500, 8500 },
+	{ "m168", 128, 0x3800, 512, 1, 1, 1, 1, 4500, 3400 },
+	{ NULL }
+};
+
+avr_profile prof;
+int baud = 19200;
+long eop_us = 10000;									// su_getchar() timeout that ends a packet
+int quiet = 0;
+int host_open = 0;										// host has the pty open
+char *dump_fname = NULL;
+
+unsigned char flash[0x10000];
+unsigned char eeprom[0x10000];
+struct timeval spm_done;								// pipelined page write busy until
+int pipe_seq = -1;
+int pipe_pages = 0;
+
+// statistics
+int n_packets = 0;
+int n_pages = 0;
+int n_ee = 0;
+
+static long tv_diff(struct timeval *a, struct timeval *b)
+{
+	return(((a->tv_sec - b->tv_sec) * 1000000L) + (a->tv_usec - b->tv_usec));
+}
+
+static void tv_add(struct timeval *tv, long usec)
+{
+	usec += tv->tv_usec;
+	tv->tv_sec += usec / 1000000L;
+	tv->tv_usec = usec % 1000000L;
+}
+
+// sleep until tv
+static void wait_until(struct timeval *tv)
+{
+	long t;
+	struct timeval now;
+	struct timespec ts;
+
+	gettimeofday(&now, NULL);
+	t = tv_diff(tv, &now);
+	if (t <= 0) return;
+	ts.tv_sec = t / 1000000L;
+	ts.tv_nsec = (t % 1000000L) * 1000L;
+	while (nanosleep(&ts, &ts) && (errno == EINTR));
+}
+
+// uS on the wire for nbytes (start, 8 data, stop)
+static long wire_time(int nbytes)
+{
+	if (baud <= 0) return(0);
+	return((nbytes * 10000000L) / baud);
+}
+
+// send like su_putbuf() - the host sees the data when the last stop bit is out
+static void su_putbuf(int fd, void *buf, int nbytes)
+{
+	struct timeval t;
+
+	gettimeofday(&t, NULL);
+	tv_add(&t, wire_time(nbytes));
+	wait_until(&t);
+	write(fd, buf, nbytes);
+}
+
+// receive like su_getbuf() - a packet ends when nothing comes in for eop_us
+// (the pty delivers at once, so the time the bytes take on the wire is added)
+// returns bytes, -1 if the host closed the port, timeout with nothing is 0
+static int su_getbuf(int fd, unsigned char *buf, int maxbytes, long first_us)
+{
+	int x, nb;
+	long t;
+	struct pollfd pfd;
+	struct timeval t0, end;
+
+	nb = 0; t = first_us;
+	while (nb < maxbytes) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		x = poll(&pfd, 1, (t + 999) / 1000);
+		if (x < 0) {
+			if (errno == EINTR) continue;
+			return(-1);
+		}
+		if (x == 0) break;
+		if ((pfd.revents & POLLHUP) && !(pfd.revents & POLLIN)) {
+			// nobody has the pty open - before the host comes that is fine
+			if (nb) break;
+			if (host_open) return(-1);
+			usleep(10000);
+			if (t != eop_us) t -= 10000;
+			if (t < 0) break;
+			continue;
+		}
+		x = read(fd, buf + nb, maxbytes - nb);
+		if (x <= 0) {
+			if ((x < 0) && ((errno == EINTR) || (errno == EAGAIN))) continue;
+			if (nb) break;
+			return(-1);
+		}
+		if (!nb) gettimeofday(&t0, NULL);
+		host_open = 1;
+		nb += x;
+		t = eop_us;
+	}
+	if (nb) {
+		end = t0;
+		tv_add(&end, wire_time(nb) + eop_us);
+		wait_until(&end);
+	}
+	return(nb);
+}
+
+// like calc_flash_crc() on the AVR
+static unsigned short flash_crc(unsigned address, unsigned end)
+{
+	unsigned short crc;
+
+	crc = 0xffff;
+	while (address < end) crc = crc_ccitt_update(crc, flash[address++ & 0xffff]);
+	return(crc);
+}
+
+// like rle_expand() on the AVR, returns expanded size (0 if it doesn't fit a page)
+static int rle_expand(unsigned char *dst, unsigned char *src, int nbytes)
+{
+	int i, n;
+	unsigned char c;
+
+	i = 0;
+	while (nbytes > 0) {
+		c = *src++; nbytes--;
+		if (c < 128) {
+			n = c + 1;
+			if ((i + n > prof.page_size) || (n > nbytes)) return(0);
+			memcpy(dst + i, src, n);
+			src += n; nbytes -= n;
+		}
+		else {
+			n = c - 125;
+			if ((i + n > prof.page_size) || !nbytes) return(0);
+			memset(dst + i, *src++, n);
+			nbytes--;
+		}
+		i += n;
+	}
+	return(i);
+}
+
+// wait for a pipelined page write (spm_finish())
+static void spm_finish(void)
+{
+	wait_until(&spm_done);
+}
+
+static int page_ok(command_buffer *cmd)
+{
+	return((cmd->nbytes == prof.page_size) && (cmd->address <= (prof.progstart - prof.page_size))
+		&& !(cmd->address % prof.page_size));
+}
+
+// handle one command packet (returns 1 for CMD_RUN)
+static int do_command(int fd, command_buffer *cmd)
+{
+	int x, y;
+	unsigned short crc;
+	unsigned char page_buf[256];
+	struct timeval t;
+
+	spm_finish();
+	y = 0;
+	switch ((unsigned char)cmd->command) {
+		case CMD_GET_SPM_PAGESIZE:
+			y = 2;
+			*(unsigned short *)cmd->buffer = prof.page_size;
+			break;
+		case CMD_READ_FLASH:
+			y = cmd->nbytes;
+			if (y > 256) y = 256;
+			for (x = 0; x < y; x++) cmd->buffer[x] = flash[(cmd->address + x) & 0xffff];
+			break;
+		case CMD_WRITE_FLASH:
+			if (page_ok(cmd)) {
+				memcpy(&flash[cmd->address], cmd->buffer, prof.page_size);
+				n_pages++;
+				gettimeofday(&t, NULL);
+				tv_add(&t, 2 * prof.spm_us);
+				wait_until(&t);
+			}
+			break;
+		case CMD_CRC_FLASH:
+			if (!prof.crc_support) break;
+			*(unsigned short *)cmd->buffer = flash_crc(cmd->address, cmd->address + cmd->nbytes);
+			cmd->nbytes = y = 2;
+			break;
+		case CMD_WRITE_FLASH_RLE:
+		case CMD_WRITE_FLASH_PIPE:
+			if (!prof.pipe_support) break;
+			if ((unsigned char)cmd->command == CMD_WRITE_FLASH_RLE) {
+				if (!prof.rle_support) break;
+				cmd->nbytes = rle_expand(page_buf, cmd->buffer, cmd->nbytes);
+				memcpy(cmd->buffer, page_buf, prof.page_size);
+			}
+			x = cmd->command >> 12;
+			if (x != pipe_seq) {
+				pipe_seq = x;
+				if (page_ok(cmd)) {
+					memcpy(&flash[cmd->address], cmd->buffer, prof.page_size);
+					n_pages++;
+					pipe_pages++;
+					// erase and write go on while the next packet comes in
+					gettimeofday(&spm_done, NULL);
+					tv_add(&spm_done, 2 * prof.spm_us);
+				}
+			}
+			*(unsigned short *)cmd->buffer = pipe_pages;
+			cmd->nbytes = y = 2;
+			break;
+		case CMD_RUN:
+			return(1);
+		case CMD_READ_EE:
+			if (!prof.ee_support) break;
+			y = cmd->nbytes;
+			if (y > 256) y = 256;
+			for (x = 0; x < y; x++) cmd->buffer[x] = eeprom[(cmd->address + x) % prof.ee_size];
+			break;
+		case CMD_WRITE_EE:
+			if (!prof.ee_support) break;
+			gettimeofday(&t, NULL);
+			for (x = 0; (x < cmd->nbytes) && (x < 256); x++) {
+				if (eeprom[(cmd->address + x) % prof.ee_size] != cmd->buffer[x]) {
+					eeprom[(cmd->address + x) % prof.ee_size] = cmd->buffer[x];
+					tv_add(&t, prof.ee_us);
+					n_ee++;
+				}
+			}
+			wait_until(&t);
+			break;
+	}
+	cmd->command |= CMD_OK;
+	crc = calc_crc((unsigned char *)cmd, y + CMD_HEADSIZE);
+	memcpy(&cmd->buffer[y], &crc, 2);
+	su_putbuf(fd, cmd, y + CMD_MINSIZE);
+	return(0);
+}
+
+// what the bootloader's main() does after a reset (returns 1 after CMD_RUN, 0 when the host went away)
+static int boot(int fd)
+{
+	int x, lp;
+	unsigned short crc;
+	command_buffer cmd;
+	char str[32];
+
+	// wait for a space
+	while (1) {
+		x = su_getbuf(fd, (unsigned char *)str, sizeof(str), AUTOBAUD_TIME);
+		if (x < 0) return(0);
+		if ((x > 0) && memchr(str, ' ', x)) break;
+	}
+	su_putbuf(fd, BOOT_OSCCAL, strlen(BOOT_OSCCAL));
+	// su_getchar(); su_getchar(); - whatever comes in now is lost
+	su_getbuf(fd, (unsigned char *)str, sizeof(str), eop_us);
+	su_getbuf(fd, (unsigned char *)str, sizeof(str), eop_us);
+	// wait for "MON"
+	for (lp = 0; lp < MON_TRIES; lp++) {
+		x = su_getbuf(fd, (unsigned char *)str, sizeof(str) - 1, eop_us);
+		if (x < 0) return(0);
+		str[x > 0 ? x : 0] = 0;
+		if (!strcmp("MON\r\n", str)) break;
+	}
+	if (lp >= MON_TRIES) return(0);
+	su_putbuf(fd, BOOT_OK, strlen(BOOT_OK));
+	if (!quiet) fprintf(stderr, "avrsim: connected\n");
+	// be_slave()
+	while (1) {
+		x = su_getbuf(fd, (unsigned char *)&cmd, sizeof(cmd), 3600000000L);
+		if (x < 0) return(0);
+		if (x < CMD_MINSIZE) continue;
+		crc = calc_crc((unsigned char *)&cmd, x - 2);
+		if (memcmp(&crc, ((char *)&cmd) + (x - 2), 2)) continue;
+		n_packets++;
+		if (do_command(fd, &cmd)) return(1);
+	}
+	return(0);
+}
+
+// load intel hex file into flash
+static int load_hex(char *fname)
+{
+	int nr;
+	unsigned start, end;
+	img_map img;
+
+	img_init(&img);
+	nr = read_ihex(&img, fname, 0);
+	if (nr <= 0) return(-1);
+	start = 0;
+	while (img_next_range(&img, &start, &end) && (start < sizeof(flash))) {
+		if (end > sizeof(flash)) end = sizeof(flash);
+		img_read(&img, start, &flash[start], end - start);
+		start = end;
+	}
+	img_free(&img);
+	return(nr);
+}
+
+void show_usage(void)
+{
+	fprintf(stderr, "usage: avrsim -options\n\n");
+	fprintf(stderr, "prints the pty name to give avrboot on stdout, exits after CMD_RUN or when the pty is closed\n\n");
+	fprintf(stderr, "-m8 emulates bootload/ on an ATmega8 (64 byte pages, no EEprom, CRC, pipelined or RLE commands)\n");
+	fprintf(stderr, "-m168 emulates bootload168/ on an ATmega168 (default)\n");
+	fprintf(stderr, "-page numbytes SPM page size\n");
+	fprintf(stderr, "-baud rate paces the serial link (default 19200, 0 for no pacing)\n");
+	fprintf(stderr, "-spm microseconds for each page erase and page write (default 4500)\n");
+	fprintf(stderr, "-eop microseconds of silence that ends a packet (default 10000)\n");
+	fprintf(stderr, "-old answers like a bootloader without CRC, pipelined and RLE commands\n");
+	fprintf(stderr, "-file filename preloads flash from an intel hex file\n");
+	fprintf(stderr, "-dump filename writes flash to a binary file on exit\n");
+	fprintf(stderr, "-loop keeps going after CMD_RUN or a close (next connection is a new reset)\n");
+	fprintf(stderr, "-quiet no statistics\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int x, y, fd, loop;
+	char *pts;
+	FILE *fh;
+	struct termios tm;
+	struct timeval t0, t1;
+
+	prof = profiles[1];
+	loop = 0;
+	memset(flash, 0xff, sizeof(flash));
+	memset(eeprom, 0xff, sizeof(eeprom));
+	for (x = 1; x < argc; x++) {
+		y = x + 1;
+		if (!strcmp(argv[x], "-m8")) prof = profiles[0];
+		else if (!strcmp(argv[x], "-m168")) prof = profiles[1];
+		else if (!strcmp(argv[x], "-old")) {
+			prof.crc_support = 0;
+			prof.pipe_support = 0;
+			prof.rle_support = 0;
+		}
+		else if (!strcmp(argv[x], "-loop")) loop = 1;
+		else if (!strcmp(argv[x], "-quiet")) quiet = 1;
+		else if (!strcmp(argv[x], "-page") && (y < argc)) prof.page_size = atoi(argv[++x]);
+		else if (!strcmp(argv[x], "-baud") && (y < argc)) baud = atoi(argv[++x]);
+		else if (!strcmp(argv[x], "-spm") && (y < argc)) prof.spm_us = atol(argv[++x]);
+		else if (!strcmp(argv[x], "-eop") && (y < argc)) eop_us = atol(argv[++x]);
+		else if (!strcmp(argv[x], "-dump") && (y < argc)) dump_fname = argv[++x];
+		else if (!strcmp(argv[x], "-file") && (y < argc)) {
+			if (load_hex(argv[++x]) < 0) {
+				fprintf(stderr, "avrsim: can't load %s\n", argv[x]);
+				return(1);
+			}
+		}
+		else {
+			show_usage();
+			return(1);
+		}
+	}
+	if ((prof.page_size < 2) || (prof.page_size > 256) || (prof.page_size & 1)) {
+		fprintf(stderr, "avrsim: bad page size %d\n", prof.page_size);
+		return(1);
+	}
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((fd == -1) || grantpt(fd) || unlockpt(fd) || !(pts = ptsname(fd))) {
+		perror("avrsim: posix_openpt()");
+		return(1);
+	}
+	// raw, so the protocol bytes get through untouched
+	tcgetattr(fd, &tm);
+	cfmakeraw(&tm);
+	tcsetattr(fd, TCSANOW, &tm);
+	printf("%s\n", pts);
+	fflush(stdout);
+
+	gettimeofday(&t0, NULL);
+	do {
+		host_open = 0;
+		boot(fd);
+	} while (loop);
+	gettimeofday(&t1, NULL);
+
+	if (dump_fname) {
+		fh = fopen(dump_fname, "wb");
+		if (fh) {
+			fwrite(flash, 1, prof.progstart, fh);
+			fclose(fh);
+		}
+	}
+	if (!quiet) {
+		fprintf(stderr, "avrsim: %s %d packets, %d pages written, %d EEprom bytes in %ldms\n", prof.name,
+			n_packets, n_pages, n_ee, tv_diff(&t1, &t0) / 1000);
+	}
+	close(fd);
+	return(0);
+}
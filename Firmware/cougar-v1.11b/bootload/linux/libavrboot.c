@@ -0,0 +1,1029 @@
+/*
+  AVR boot loader communication library (Linux)
+
+  blocking calls (avr_get_spm_pagesize() ...) talk to one AVR, avr_batch() connects,
+  programs and verifies any number of AVRs at once from one select() loop
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+
+#include "libavrboot.h"
+
+// avr_batch() states
+#define ST_CONNECT 0									// sending spaces, waiting for "OSCCAL"
+#define ST_MON 1										// sent "MON", waiting for "OK"
+#define ST_PAGESIZE 2
+#define ST_CRC 3										// page CRCs before programming
+#define ST_WRITE 4
+#define ST_VERIFY 5										// CRC of each run of words in the file
+#define ST_READBACK 6									// read back a run whose CRC differs
+#define ST_DONE 7
+#define ST_FAIL 8
+
+#define SPACE_TIME 30000								// uS of silence before the next space
+
+unsigned short crc_ccitt_update (unsigned short crc, unsigned char data)
+{
+	data ^= crc & 0xff;
+	data ^= data << 4;
+	return ((((unsigned short)data << 8) | (crc >> 8)) ^ (unsigned char)(data >> 4)
+		^ ((unsigned short)data << 3));
+}
+
+// calc ccitt CRC on buffer
+unsigned short calc_crc(unsigned char *buf, unsigned nbytes)
+{
+	unsigned n;
+	unsigned short crc;
+
+	crc = 0xffff;
+	for (n = 0; n < nbytes; n++) {
+		crc = crc_ccitt_update (crc, *buf++);
+	}
+	return(crc);
+}
+
+// read intel hex file into img (crc appends ccitt crc after the last word)
+int read_ihex(img_map *img, char *fname, int crc)
+{
+	int nr;
+	unsigned lo, hi;
+	unsigned char cb[2];
+	unsigned short crcval;
+
+	img_free(img);
+	nr = img_load_ihex(img, fname, 0, &lo, &hi);
+	if (nr <= 0) return(nr);
+	// crc here
+	if (crc) {
+		lo &= ~1;
+		hi = (hi + 1) & ~1;
+		crcval = img_crc(img, lo, hi);
+		cb[0] = crcval & 0xff;
+		cb[1] = crcval >> 8;
+		img_write(img, hi, cb, 2);
+		fprintf(stderr, "start for CRC calc at byte 0x%04X\n", lo);
+		fprintf(stderr, "CRC = 0x%04X at byte 0x%04X\n", (int)crcval, hi);
+
+	}
+	return(nr / 2);
+}
+
+// copy page of the image to buf (0xff where the file has no data), return 1 if page has data
+int image_page(const img_map *img, int page, int spm_ps, char *buf)
+{
+	return(img_read(img, page * spm_ps, (unsigned char *)buf, spm_ps) > 0);
+}
+
+// RLE compress a page for CMD_WRITE_FLASH_RLE (returns compressed size)
+// control byte n < 128: n + 1 bytes follow as is, n >= 128: next byte repeated n - 125 times
+int rle_compress(unsigned char *src, int nbytes, unsigned char *dst)
+{
+	int x, y, z, lit;
+
+	x = 0; z = 0; lit = -1;
+	while (x < nbytes) {
+		for (y = x + 1; (y < nbytes) && (src[y] == src[x]) && ((y - x) < 130); y++);
+		if ((y - x) >= 3) {
+			// run
+			dst[z++] = (y - x) + 125;
+			dst[z++] = src[x];
+			x = y; lit = -1;
+		}
+		else {
+			// literal - add to the open literal block if there is room
+			if ((lit < 0) || (dst[lit] == 127)) {
+				lit = z++;
+				dst[lit] = 0;
+			}
+			else dst[lit]++;
+			dst[z++] = src[x++];
+		}
+	}
+	return(z);
+}
+
+// message to stderr with the device name in front
+void avr_msg(avr_dev *dev, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (dev->name[0]) fprintf(stderr, "%s: ", dev->name);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+// open serial device, set to 19200 and set default options
+int avr_open(avr_dev *dev, char *devname)
+{
+	int x, fd;
+	struct termios tmios;
+	struct termios *tm;
+
+	memset(dev, 0, sizeof(avr_dev));
+	dev->fd = -1;
+	dev->verbose = 1;
+	dev->baud = 19200;
+	dev->page_crc = 1;
+	dev->pipe_write = 1;
+	dev->rle = 1;
+	dev->crc_cmd = 1;
+	dev->pipe_seq = 1;
+	tm = &tmios;
+	fd = open(devname, O_RDWR | O_EXCL);
+	if (fd == -1) {
+		fprintf(stderr, "od-open()");
+		return(-1);
+	}
+	if (isatty(fd)) {
+		dev->tty = 1;
+		memset(tm, 0, sizeof(struct termios));
+		tm->c_cflag = CREAD | CLOCAL | HUPCL | CSIZE | CS8;
+		cfsetospeed(tm, B19200);
+		cfsetispeed(tm, B19200);
+		x = tcsetattr(fd, TCSANOW, tm);
+		if (x == -1) {
+			fprintf(stderr, "od-tcsetattr() %s\n", strerror(errno));
+			close(fd);
+			return(-1);
+		}
+		x = tcflush(fd, TCIOFLUSH);
+		if (x == -1) {
+			fprintf(stderr, "od-tcflush()");
+			close(fd);
+			return(-1);
+		}
+
+	}
+	dev->fd = fd;
+	return(fd);
+}
+
+void avr_close(avr_dev *dev)
+{
+	if (dev->fd >= 0) close(dev->fd);
+	dev->fd = -1;
+	free(dev->todo);
+	dev->todo = NULL;
+}
+
+// change baudrate of open device (firmware always talks at 19200, bootloader measures the first space)
+int avr_set_baud(avr_dev *dev, int rate)
+{
+	int x;
+	speed_t sp;
+	struct termios tmios;
+
+	switch (rate) {
+		case 19200: sp = B19200; break;
+		case 38400: sp = B38400; break;
+		case 57600: sp = B57600; break;
+		case 115200: sp = B115200; break;
+		default:
+			avr_msg(dev, "unsupported baudrate %d\n", rate);
+			return(-1);
+	}
+	if (!isatty(dev->fd)) return(0);
+	// let "restart" go out at the old rate
+	tcdrain(dev->fd);
+	x = tcgetattr(dev->fd, &tmios);
+	if (x == -1) {
+		avr_msg(dev, "sb-tcgetattr() %s\n", strerror(errno));
+		return(-1);
+	}
+	cfsetospeed(&tmios, sp);
+	cfsetispeed(&tmios, sp);
+	x = tcsetattr(dev->fd, TCSANOW, &tmios);
+	if (x == -1) {
+		avr_msg(dev, "sb-tcsetattr() %s\n", strerror(errno));
+		return(-1);
+	}
+	return(0);
+}
+
+// wake up when n bytes are in (termios VMIN with VTIME 0 also sets the poll() threshold)
+static void set_vmin(avr_dev *dev, int n)
+{
+	struct termios tmios;
+
+	if (n > 255) n = 255;
+	if (n < 1) n = 1;
+	if (!dev->tty || (n == dev->vmin)) return;
+	if (tcgetattr(dev->fd, &tmios) == -1) return;
+	tmios.c_cc[VMIN] = n;
+	tmios.c_cc[VTIME] = 0;
+	if (tcsetattr(dev->fd, TCSANOW, &tmios) == 0) dev->vmin = n;
+}
+
+static long tv_diff(struct timeval *a, struct timeval *b)
+{
+	return(((a->tv_sec - b->tv_sec) * 1000000L) + (a->tv_usec - b->tv_usec));
+}
+
+static void tv_add(struct timeval *tv, long usec)
+{
+	usec += tv->tv_usec;
+	tv->tv_sec += usec / 1000000L;
+	tv->tv_usec = usec % 1000000L;
+}
+
+// read nbytes, one wake up per packet (returns bytes read, less on timeout, -1 on error)
+static int read_packet(avr_dev *dev, char *buf, int nbytes, long usec)
+{
+	int x, bufpos;
+	long t;
+	struct pollfd pfd;
+	struct timeval now, end;
+
+	bufpos = 0;
+	gettimeofday(&end, NULL);
+	tv_add(&end, usec);
+	while (bufpos < nbytes) {
+		set_vmin(dev, nbytes - bufpos);
+		gettimeofday(&now, NULL);
+		t = tv_diff(&end, &now);
+		if (t < 0) break;						// timeout
+		pfd.fd = dev->fd;
+		pfd.events = POLLIN;
+		x = poll(&pfd, 1, (t + 999) / 1000);
+		if (x < 0) {
+			// error
+			if (errno != EINTR) return(-1);
+		}
+		else if (x == 0) break;					// timeout
+		else {
+			x = read(dev->fd, &buf[bufpos], nbytes - bufpos);
+			if (x < 0) {
+				// error
+				if ((errno != EINTR) && (errno != EAGAIN)) return(-1);
+			}
+			else if (x == 0) return(-1);		// connection broken
+			else bufpos = bufpos + x;
+		}
+	}
+	return(bufpos);
+}
+
+// OSCCAL value from the bootloader's greeting (-1 if none)
+static int osccal_value(char *buf)
+{
+	char *s;
+
+	s = strchr(buf, '=');
+	if (s) return(atoi(s + 1));
+	return(-1);
+}
+
+// establish connection with AVR (autobaud sequence) and get the page size
+int avr_connect(avr_dev *dev)
+{
+	int program, verify;
+
+	program = dev->program;
+	verify = dev->verify;
+	dev->program = 0;
+	dev->verify = 0;
+	avr_batch(dev, 1, NULL);
+	dev->program = program;
+	dev->verify = verify;
+	if (dev->result) return(dev->result);
+	return(1);
+}
+
+// record round trip time of the packet just answered
+static void avr_rtt(avr_dev *dev)
+{
+	long t;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	t = tv_diff(&now, &dev->t_sent);
+	if (!dev->packets || (t < dev->rtt_min)) dev->rtt_min = t;
+	if (t > dev->rtt_max) dev->rtt_max = t;
+	dev->rtt_sum += t;
+	dev->packets++;
+}
+
+// restart avr (when running firmware)
+void avr_restart(avr_dev *dev)
+{
+	write(dev->fd, "\rrestart\r", 9);
+}
+
+// build command packet in dev->cmd (ndata bytes of data follow the header), return packet size
+static int avr_build(avr_dev *dev, int command, int address, int nbytes, const void *data, int ndata)
+{
+	unsigned short crc;
+
+	dev->cmd.command = command;
+	dev->cmd.address = address;
+	dev->cmd.nbytes = nbytes;
+	if (ndata) memcpy(dev->cmd.buffer, data, ndata);
+	crc = calc_crc((unsigned char *)&dev->cmd, ndata + CMD_HEADSIZE);
+	memcpy(&dev->cmd.buffer[ndata], &crc, 2);
+	dev->sent_command = command;
+	dev->sent_nbytes = nbytes;
+	return(ndata + CMD_MINSIZE);
+}
+
+// bytes of the reply to wait for before looking at its header
+static int avr_reply_first(avr_dev *dev)
+{
+	switch (dev->sent_command & 0xff) {
+		case CMD_GET_SPM_PAGESIZE:
+		case CMD_READ_FLASH:
+		case CMD_READ_EE:
+			return(CMD_MINSIZE + dev->sent_nbytes);
+	}
+	return(CMD_MINSIZE);
+}
+
+// size of the reply to the last command (dev->rx header must be in)
+static int avr_reply_size(avr_dev *dev)
+{
+	switch (dev->sent_command & 0xff) {
+		case CMD_GET_SPM_PAGESIZE:
+		case CMD_READ_FLASH:
+		case CMD_READ_EE:
+			return(CMD_MINSIZE + dev->sent_nbytes);
+		case CMD_CRC_FLASH:
+		case CMD_WRITE_FLASH_PIPE:
+		case CMD_WRITE_FLASH_RLE:
+			// old bootloaders answer with an empty packet that echoes our nbytes
+			if (dev->rx.nbytes == 2) return(CMD_MINSIZE + 2);
+			return(CMD_MINSIZE);
+	}
+	return(CMD_MINSIZE);
+}
+
+// check reply of len bytes (0 ok, -2 CRC error, -3 not OK, -4 bootloader doesn't know the command)
+static int avr_reply_check(avr_dev *dev, int len)
+{
+	unsigned short crc;
+
+	crc = *(unsigned short *)(((char *)&dev->rx) + (len - 2));
+	if (crc != calc_crc((unsigned char *)&dev->rx, len - 2)) return(-2);
+	if (dev->rx.command != (dev->sent_command | CMD_OK)) return(-3);
+	if ((len == CMD_MINSIZE) && (avr_reply_size(dev) == CMD_MINSIZE) && (dev->rx.nbytes != 2)) {
+		switch (dev->sent_command & 0xff) {
+			case CMD_CRC_FLASH:
+			case CMD_WRITE_FLASH_PIPE:
+			case CMD_WRITE_FLASH_RLE:
+				return(-4);
+		}
+	}
+	return(0);
+}
+
+// send command and wait for the reply (-1 timeout, else as avr_reply_check())
+static int avr_transact(avr_dev *dev, int command, int address, int nbytes, const void *data, int ndata)
+{
+	int x, n;
+
+	n = avr_build(dev, command, address, nbytes, data, ndata);
+	x = avr_reply_first(dev);
+	set_vmin(dev, x);
+	gettimeofday(&dev->t_sent, NULL);
+	write(dev->fd, &dev->cmd, n);
+	if (read_packet(dev, (char *)&dev->rx, x, CMD_MAXTIME) != x) return(-1);
+	n = avr_reply_size(dev);
+	if (n > x) {
+		if (read_packet(dev, ((char *)&dev->rx) + x, n - x, CMD_MAXTIME) != (n - x)) return(-1);
+	}
+	avr_rtt(dev);
+	return(avr_reply_check(dev, n));
+}
+
+// reset avr (jump to application, no reply)
+void avr_reset(avr_dev *dev)
+{
+	int n;
+
+	n = avr_build(dev, CMD_RUN, 0, 0, NULL, 0);
+	// offsetof so gcc doesn't take &dev->cmd for the 2 byte command field
+	write(dev->fd, (char *)dev + offsetof(avr_dev, cmd), n);
+	// don't close the port before it is out
+	if (dev->tty) tcdrain(dev->fd);
+}
+
+// read AVR's SPM_PAGESIZE memory
+int avr_get_spm_pagesize(avr_dev *dev)
+{
+	int x;
+
+	x = avr_transact(dev, CMD_GET_SPM_PAGESIZE, 0, 2, NULL, 0);
+	if (x) return(x);
+	x = *(unsigned short *)dev->rx.buffer;
+	return(x);
+}
+
+// read AVR's flash memory
+int avr_read_flash_block(avr_dev *dev, int address, int nbytes, char *buf)
+{
+	int x;
+
+	x = avr_transact(dev, CMD_READ_FLASH, address, nbytes, NULL, 0);
+	if (x) return(x);
+	memcpy(buf, dev->rx.buffer, nbytes);
+	return(0);
+}
+
+// read AVR's EE memory
+int avr_read_ee_block(avr_dev *dev, int address, int nbytes, char *buf)
+{
+	int x;
+
+	x = avr_transact(dev, CMD_READ_EE, address, nbytes, NULL, 0);
+	if (x) return(x);
+	memcpy(buf, dev->rx.buffer, nbytes);
+	return(0);
+}
+
+// write AVR's flash memory (stop and wait)
+int avr_write_flash_block(avr_dev *dev, int address, int nbytes, char *buf)
+{
+	int x;
+
+	x = avr_transact(dev, CMD_WRITE_FLASH, address, nbytes, buf, nbytes);
+	if (x) return(x);
+	return(0);
+}
+
+// write AVR's EE memory
+int avr_write_ee_block(avr_dev *dev, int address, int nbytes, char *buf)
+{
+	int x;
+
+	x = avr_transact(dev, CMD_WRITE_EE, address, nbytes, buf, nbytes);
+	if (x) return(x);
+	return(0);
+}
+
+// get CRC of AVR's flash memory (-4 if the bootloader doesn't know CMD_CRC_FLASH)
+int avr_crc_flash_block(avr_dev *dev, int address, int nbytes)
+{
+	int x;
+
+	x = avr_transact(dev, CMD_CRC_FLASH, address, nbytes, NULL, 0);
+	if (x) return(x);
+	return(*(unsigned short *)dev->rx.buffer);
+}
+
+// read whole EEprom into buf in EE_CHUNK pieces (each reply has its own CRC)
+int avr_read_ee(avr_dev *dev, char *buf, int nbytes)
+{
+	int x, y;
+
+	for (y = 0; y < nbytes; y += EE_CHUNK) {
+		x = avr_read_ee_block(dev, y, ((nbytes - y) < EE_CHUNK) ? (nbytes - y) : EE_CHUNK, buf + y);
+		if (x) {
+			avr_msg(dev, "avr_read_ee_block(0x%x) = %d (bootloader built without EE_SUPPORT?)\n", y, x);
+			return(x);
+		}
+	}
+	return(0);
+}
+
+// save AVR's EEprom to a binary file (byte n of the file is EEprom address n)
+int avr_ee_backup(avr_dev *dev, char *fname, int eesize)
+{
+	int x;
+	FILE *fh;
+	char buf[0x10000];
+
+	x = avr_read_ee(dev, buf, eesize);
+	if (x) return(x);
+	fh = fopen(fname, "wb");
+	if (!fh) {
+		avr_msg(dev, "can't create %s - %s\n", fname, strerror(errno));
+		return(-1);
+	}
+	x = fwrite(buf, 1, eesize, fh);
+	fclose(fh);
+	if (x != eesize) {
+		avr_msg(dev, "can't write %s - %s\n", fname, strerror(errno));
+		return(-1);
+	}
+	avr_msg(dev, "saved %d bytes of EEprom to %s (crc 0x%04x)\n", eesize, fname, calc_crc((unsigned char *)buf, eesize));
+	return(0);
+}
+
+// write a binary file back to AVR's EEprom
+// only the span of each chunk that differs is sent and the bootloader only writes bytes that changed
+int avr_ee_restore(avr_dev *dev, char *fname, int eesize)
+{
+	int x, y, z, first, last, nb, changed;
+	FILE *fh;
+	char buf[0x10000];
+	char cur[0x10000];
+
+	fh = fopen(fname, "rb");
+	if (!fh) {
+		avr_msg(dev, "can't open %s - %s\n", fname, strerror(errno));
+		return(-1);
+	}
+	nb = fread(buf, 1, sizeof(buf), fh);
+	fclose(fh);
+	if (nb != eesize) {
+		avr_msg(dev, "%s has %d bytes, EEprom has %d (-eesize)\n", fname, nb, eesize);
+		return(-1);
+	}
+	x = avr_read_ee(dev, cur, eesize);
+	if (x) return(x);
+	changed = 0;
+	for (y = 0; y < eesize; y += EE_CHUNK) {
+		first = -1; last = -1;
+		for (z = y; (z < eesize) && (z < (y + EE_CHUNK)); z++) {
+			if (buf[z] != cur[z]) {
+				if (first < 0) first = z;
+				last = z;
+				changed++;
+			}
+		}
+		if (first < 0) continue;
+		x = avr_write_ee_block(dev, first, (last - first) + 1, buf + first);
+		if (dev->verbose) avr_msg(dev, "avr_write_ee_block(0x%x, %d) = %d\n", first, (last - first) + 1, x);
+		if (x) return(x);
+	}
+	// read back
+	x = avr_read_ee(dev, cur, eesize);
+	if (x) return(x);
+	if (memcmp(buf, cur, eesize)) {
+		avr_msg(dev, "EEprom verify error\n");
+		return(1);
+	}
+	avr_msg(dev, "restored %s to EEprom (%d bytes changed, crc 0x%04x)\n", fname, changed, calc_crc((unsigned char *)buf, eesize));
+	return(0);
+}
+
+
+/*
+  avr_batch() - every device runs the same job (connect, page size, page CRCs, write, verify)
+  as a state machine, one select() loop waits for all of them
+*/
+
+static void batch_fail(avr_dev *dev, int result, const char *why)
+{
+	avr_msg(dev, "%s (%d)\n", why, result);
+	dev->result = result ? result : 1;
+	dev->state = ST_FAIL;
+	gettimeofday(&dev->t_done, NULL);
+}
+
+// send command, poll() wakes up when the reply is in
+static void batch_send(avr_dev *dev, int command, int address, int nbytes, const void *data, int ndata)
+{
+	int n;
+
+	n = avr_build(dev, command, address, nbytes, data, ndata);
+	dev->rx_pos = 0;
+	set_vmin(dev, avr_reply_first(dev));
+	gettimeofday(&dev->t_sent, NULL);
+	write(dev->fd, &dev->cmd, n);
+	dev->deadline = dev->t_sent;
+	tv_add(&dev->deadline, CMD_MAXTIME);
+}
+
+static void batch_done(avr_dev *dev)
+{
+	dev->state = ST_DONE;
+	gettimeofday(&dev->t_done, NULL);
+}
+
+// next run of words in the file to verify, or done
+static void batch_next_run(avr_dev *dev)
+{
+	unsigned start, end;
+
+	start = dev->run_end;
+	if (!img_next_range(dev->img, &start, &end)) {
+		avr_msg(dev, "verify OK\n");
+		batch_done(dev);
+		return;
+	}
+	// the AVR works in words
+	dev->run_start = start & ~1;
+	dev->run_end = (end + 1) & ~1;
+	if (dev->crc_cmd && !dev->readback) {
+		dev->state = ST_VERIFY;
+		batch_send(dev, CMD_CRC_FLASH, dev->run_start, dev->run_end - dev->run_start, NULL, 0);
+	}
+	else {
+		dev->state = ST_READBACK;
+		dev->page = dev->run_start / dev->spm_ps;
+		batch_send(dev, CMD_READ_FLASH, dev->page * dev->spm_ps, dev->spm_ps, NULL, 0);
+	}
+}
+
+static void batch_start_verify(avr_dev *dev)
+{
+	dev->run_end = 0;
+	batch_next_run(dev);
+}
+
+// send current page (RLE if shorter, pipelined, or stop and wait)
+static void batch_send_page(avr_dev *dev)
+{
+	int z;
+	char buf[512];
+	unsigned char rbuf[512];
+
+	image_page(dev->img, dev->page, dev->spm_ps, buf);
+	if (dev->pipe_write && dev->rle) {
+		z = rle_compress((unsigned char *)buf, dev->spm_ps, rbuf);
+		if (z < dev->spm_ps) {
+			batch_send(dev, CMD_WRITE_FLASH_RLE | (dev->pipe_seq << 12), dev->page * dev->spm_ps, z, rbuf, z);
+			return;
+		}
+	}
+	if (dev->pipe_write) {
+		batch_send(dev, CMD_WRITE_FLASH_PIPE | (dev->pipe_seq << 12), dev->page * dev->spm_ps, dev->spm_ps, buf, dev->spm_ps);
+		return;
+	}
+	batch_send(dev, CMD_WRITE_FLASH, dev->page * dev->spm_ps, dev->spm_ps, buf, dev->spm_ps);
+}
+
+// next page to write, or on to verify
+static void batch_next_write(avr_dev *dev)
+{
+	while ((++dev->todo_pos < dev->ntodo) && (dev->todo[dev->todo_pos] < 0));
+	if (dev->todo_pos < dev->ntodo) {
+		dev->page = dev->todo[dev->todo_pos];
+		dev->state = ST_WRITE;
+		dev->retries = 0;
+		batch_send_page(dev);
+		return;
+	}
+	gettimeofday(&dev->t_done, NULL);
+	avr_summary(dev);
+	if (dev->verify) batch_start_verify(dev);
+	else batch_done(dev);
+}
+
+// next page to ask the CRC of, or on to writing
+static void batch_next_crc(avr_dev *dev)
+{
+	if ((++dev->todo_pos < dev->ntodo) && dev->page_crc && dev->crc_cmd) {
+		dev->page = dev->todo[dev->todo_pos];
+		dev->state = ST_CRC;
+		batch_send(dev, CMD_CRC_FLASH, dev->page * dev->spm_ps, dev->spm_ps, NULL, 0);
+		return;
+	}
+	dev->todo_pos = -1;
+	batch_next_write(dev);
+}
+
+// list the pages that have data (walks the ranges in the image, not the whole flash)
+static void batch_plan(avr_dev *dev)
+{
+	int page, last;
+	unsigned start, end;
+
+	dev->ntodo = 0; last = -1;
+	start = 0;
+	while (img_next_range(dev->img, &start, &end)) {
+		for (page = start / dev->spm_ps; page <= ((end - 1) / dev->spm_ps); page++) {
+			if (page == last) continue;
+			dev->todo = realloc(dev->todo, (dev->ntodo + 1) * sizeof(int));
+			dev->todo[dev->ntodo++] = page;
+			last = page;
+		}
+		start = end;
+	}
+	dev->todo_pos = -1;
+}
+
+// start of job once the page size is known
+static void batch_start(avr_dev *dev)
+{
+	if (dev->program) {
+		gettimeofday(&dev->t_start, NULL);
+		batch_plan(dev);
+		batch_next_crc(dev);
+	}
+	else if (dev->verify) batch_start_verify(dev);
+	else batch_done(dev);
+}
+
+// reply (r = 0) or error (-1 timeout, -2 CRC, -3 not OK, -4 unknown command) for the current state
+static void batch_step(avr_dev *dev, int r)
+{
+	int x, z;
+	char buf[512];
+
+	switch (dev->state) {
+		case ST_PAGESIZE:
+			x = *(unsigned short *)dev->rx.buffer;
+			if (r || (x <= 0) || (x > 256)) {
+				batch_fail(dev, r, "failed to get spm page size");
+				break;
+			}
+			dev->spm_ps = x;
+			if (dev->verbose) avr_msg(dev, "avr_get_spm_pagesize() = %d\n", x);
+			batch_start(dev);
+			break;
+
+		case ST_CRC:
+			if (r == 0) {
+				image_page(dev->img, dev->page, dev->spm_ps, buf);
+				if (*(unsigned short *)dev->rx.buffer == calc_crc((unsigned char *)buf, dev->spm_ps)) {
+					dev->todo[dev->todo_pos] = -1;
+					dev->pages_skipped++;
+				}
+			}
+			else if (r == -4) {
+				avr_msg(dev, "bootloader has no flash CRC - writing all pages\n");
+				dev->crc_cmd = 0;
+			}
+			else {
+				batch_fail(dev, r, "avr_crc_flash_block() failed");
+				break;
+			}
+			batch_next_crc(dev);
+			break;
+
+		case ST_WRITE:
+			x = dev->sent_command & 0xff;
+			if (r == -4) {
+				// try again without RLE or without the pipeline
+				if (x == CMD_WRITE_FLASH_RLE) {
+					avr_msg(dev, "bootloader has no RLE write - sending raw pages\n");
+					dev->rle = 0;
+				}
+				else {
+					avr_msg(dev, "bootloader has no pipelined write - using stop and wait\n");
+					dev->pipe_write = 0;
+				}
+				batch_send_page(dev);
+				break;
+			}
+			if (((r == -1) || (r == -2)) && (x != CMD_WRITE_FLASH) && (++dev->retries < CMD_RETRIES)) {
+				// resend with the same sequence, the AVR won't program it twice
+				tcflush(dev->fd, TCIFLUSH);
+				batch_send_page(dev);
+				break;
+			}
+			if (r) {
+				batch_fail(dev, r, "avr_write_flash_page() failed");
+				break;
+			}
+			dev->bytes_raw += dev->spm_ps;
+			dev->bytes_sent += dev->sent_nbytes;
+			if (x != CMD_WRITE_FLASH) {
+				dev->pipe_seq = (dev->pipe_seq % 15) + 1;
+				// AVR's page count must match ours
+				if (*(unsigned short *)dev->rx.buffer != ++dev->pipe_pages) {
+					batch_fail(dev, -5, "page count from AVR is wrong");
+					break;
+				}
+			}
+			dev->pages_written++;
+			if (dev->verbose) avr_msg(dev, "avr_write_flash_page(0x%x) = 0\n", dev->page * dev->spm_ps);
+			batch_next_write(dev);
+			break;
+
+		case ST_VERIFY:
+			if (r == 0) {
+				x = *(unsigned short *)dev->rx.buffer;
+				if (dev->verbose) avr_msg(dev, "avr_crc_flash_block(0x%x, %d) = 0x%04x\n", dev->run_start, dev->run_end - dev->run_start, x);
+				if (x == img_crc(dev->img, dev->run_start, dev->run_end)) {
+					batch_next_run(dev);
+					break;
+				}
+			}
+			else if (r == -4) {
+				avr_msg(dev, "bootloader has no flash CRC - reading back\n");
+				dev->crc_cmd = 0;
+			}
+			else {
+				batch_fail(dev, r, "avr_crc_flash_block() failed");
+				break;
+			}
+			// read back the run to find the bad word
+			dev->state = ST_READBACK;
+			dev->page = dev->run_start / dev->spm_ps;
+			batch_send(dev, CMD_READ_FLASH, dev->page * dev->spm_ps, dev->spm_ps, NULL, 0);
+			break;
+
+		case ST_READBACK:
+			if (r) {
+				batch_fail(dev, r, "avr_read_flash_block() failed");
+				break;
+			}
+			if (dev->verbose) avr_msg(dev, "avr_read_flash_block(0x%x) = 0\n", dev->page * dev->spm_ps);
+			image_page(dev->img, dev->page, dev->spm_ps, buf);
+			for (z = 0; z < dev->spm_ps; z++) {
+				x = (dev->page * dev->spm_ps) + z;
+				if ((x < dev->run_start) || (x >= dev->run_end)) continue;
+				if (dev->rx.buffer[z] != (unsigned char)buf[z]) {
+					avr_msg(dev, "verify error at 0x%x\n", x);
+					batch_fail(dev, 1, "program verify error");
+					return;
+				}
+			}
+			dev->page++;
+			if ((dev->page * dev->spm_ps) < dev->run_end) {
+				batch_send(dev, CMD_READ_FLASH, dev->page * dev->spm_ps, dev->spm_ps, NULL, 0);
+			}
+			else batch_next_run(dev);
+			break;
+	}
+}
+
+// text from the bootloader while connecting
+static void batch_text(avr_dev *dev, char *buf, int n)
+{
+	int x;
+	struct timeval now;
+
+	for (x = 0; x < n; x++) {
+		if (dev->text_len >= (sizeof(dev->text) - 1)) {
+			memmove(dev->text, dev->text + 1, sizeof(dev->text) - 2);
+			dev->text_len--;
+		}
+		dev->text[dev->text_len++] = buf[x] ? buf[x] : '.';
+	}
+	dev->text[dev->text_len] = 0;
+	gettimeofday(&now, NULL);
+	if (dev->state == ST_CONNECT) {
+		// next space (or "MON") only after SPACE_TIME of silence, the bootloader
+		// throws away what comes in right after its greeting
+		dev->tx_time = now;
+		tv_add(&dev->tx_time, SPACE_TIME);
+		if (strstr(dev->text, "OSCCAL")) {
+			if (dev->verbose) avr_msg(dev, "got OSCCAL (%d)\n", osccal_value(dev->text));
+			dev->state = ST_MON;
+			dev->mon_sent = 0;
+			dev->text_len = 0;
+		}
+	}
+	else if (!dev->mon_sent) {
+		dev->tx_time = now;
+		tv_add(&dev->tx_time, SPACE_TIME);
+	}
+	else if (strstr(dev->text, "OK\r\n")) {
+		// the whole line is in, the next byte is the first of a reply
+		dev->connect_us = tv_diff(&now, &dev->t_begin);
+		avr_msg(dev, "got OK - connected\n");
+		dev->state = ST_PAGESIZE;
+		batch_send(dev, CMD_GET_SPM_PAGESIZE, 0, 2, NULL, 0);
+	}
+}
+
+// data from the AVR
+static void batch_read(avr_dev *dev)
+{
+	int x, want;
+	char buf[64];
+
+	if (dev->state <= ST_MON) {
+		x = read(dev->fd, buf, sizeof(buf));
+		if (x > 0) batch_text(dev, buf, x);
+	}
+	else {
+		want = avr_reply_first(dev);
+		if (dev->rx_pos >= CMD_MINSIZE) want = avr_reply_size(dev);
+		x = read(dev->fd, ((char *)&dev->rx) + dev->rx_pos, want - dev->rx_pos);
+		if (x > 0) {
+			dev->rx_pos += x;
+			if (dev->rx_pos >= CMD_MINSIZE) {
+				want = avr_reply_size(dev);
+				if (dev->rx_pos >= want) {
+					avr_rtt(dev);
+					batch_step(dev, avr_reply_check(dev, want));
+				}
+				else set_vmin(dev, want - dev->rx_pos);
+			}
+			else set_vmin(dev, CMD_MINSIZE - dev->rx_pos);
+		}
+	}
+	if (x == 0) batch_fail(dev, -1, "connection broken");
+	else if ((x < 0) && (errno != EINTR) && (errno != EAGAIN)) batch_fail(dev, -1, strerror(errno));
+}
+
+// spaces and "MON" while connecting, timeouts
+static void batch_timer(avr_dev *dev, struct timeval *now)
+{
+	if ((dev->state <= ST_MON) && !dev->mon_sent && (tv_diff(now, &dev->tx_time) >= 0)) {
+		if (dev->state == ST_CONNECT) write(dev->fd, " ", 1);
+		else {
+			write(dev->fd, "MON\r\n", 5);
+			dev->mon_sent = 1;
+		}
+		dev->tx_time = *now;
+		tv_add(&dev->tx_time, SPACE_TIME);
+	}
+	if (tv_diff(now, &dev->deadline) >= 0) {
+		if (dev->state <= ST_MON) batch_fail(dev, -1, "failed to connect to avr");
+		else batch_step(dev, -1);
+	}
+}
+
+// connect to, program and verify (as set in each avr_dev) all devices at once
+// returns number of devices that failed
+int avr_batch(avr_dev *devs, int ndev, const img_map *img)
+{
+	int x, active, failed;
+	long wait, t;
+	avr_dev *dev;
+	struct pollfd pfd[ndev];
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	for (x = 0; x < ndev; x++) {
+		dev = &devs[x];
+		dev->img = img;
+		dev->state = ST_CONNECT;
+		dev->result = 0;
+		dev->text_len = 0;
+		dev->mon_sent = 0;
+		dev->t_begin = now;
+		if (dev->restart) avr_restart(dev);
+		if ((dev->baud != 19200) && avr_set_baud(dev, dev->baud)) {
+			batch_fail(dev, -1, "can't set baudrate");
+			continue;
+		}
+		set_vmin(dev, 1);
+		dev->tx_time = now;
+		dev->deadline = now;
+		tv_add(&dev->deadline, CONNECT_MAXTIME * 1000000L);
+	}
+	while (1) {
+		active = 0; wait = CMD_MAXTIME;
+		gettimeofday(&now, NULL);
+		for (x = 0; x < ndev; x++) {
+			dev = &devs[x];
+			pfd[x].fd = -1;
+			pfd[x].events = POLLIN;
+			pfd[x].revents = 0;
+			if (dev->state >= ST_DONE) continue;
+			active++;
+			pfd[x].fd = dev->fd;
+			if ((dev->state <= ST_MON) && !dev->mon_sent) {
+				t = tv_diff(&dev->tx_time, &now);
+				if (t < wait) wait = t;
+			}
+			t = tv_diff(&dev->deadline, &now);
+			if (t < wait) wait = t;
+		}
+		if (!active) break;
+		if (wait < 0) wait = 0;
+		x = poll(pfd, ndev, (wait + 999) / 1000);
+		if ((x < 0) && (errno != EINTR)) {
+			perror("poll()");
+			break;
+		}
+		gettimeofday(&now, NULL);
+		for (x = 0; x < ndev; x++) {
+			dev = &devs[x];
+			if (dev->state >= ST_DONE) continue;
+			if (pfd[x].revents & (POLLIN | POLLHUP | POLLERR)) batch_read(dev);
+			if (dev->state >= ST_DONE) continue;
+			batch_timer(dev, &now);
+		}
+	}
+	failed = 0;
+	for (x = 0; x < ndev; x++) {
+		if (devs[x].state != ST_DONE) failed++;
+	}
+	return(failed);
+}
+
+// connection and link statistics
+void avr_timing(avr_dev *dev)
+{
+	if (!dev->connect_us) return;
+	avr_msg(dev, "connected in %ld.%03lds", dev->connect_us / 1000000L, (dev->connect_us / 1000L) % 1000L);
+	if (dev->packets) fprintf(stderr, ", %d packets, round trip min/avg/max %ld.%ld/%ld.%ld/%ld.%ldms\n", dev->packets,
+		dev->rtt_min / 1000, (dev->rtt_min / 100) % 10,
+		(dev->rtt_sum / dev->packets) / 1000, ((dev->rtt_sum / dev->packets) / 100) % 10,
+		dev->rtt_max / 1000, (dev->rtt_max / 100) % 10);
+	else fprintf(stderr, "\n");
+}
+
+// programming statistics
+void avr_summary(avr_dev *dev)
+{
+	int z;
+
+	z = tv_diff(&dev->t_done, &dev->t_start) / 1000;
+	avr_msg(dev, "programmed (%d pages written, %d unchanged) in %d.%03ds", dev->pages_written, dev->pages_skipped, z / 1000, z % 1000);
+	if (dev->pages_written && z) fprintf(stderr, " - %d bytes/s %s\n", (dev->pages_written * dev->spm_ps * 1000) / z, dev->pipe_write ? "pipelined" : "stop and wait");
+	else fprintf(stderr, "\n");
+	if (dev->bytes_raw) avr_msg(dev, "sent %d of %d bytes (%d%%)\n", dev->bytes_sent, dev->bytes_raw, (dev->bytes_sent * 100) / dev->bytes_raw);
+}
@@ -0,0 +1,141 @@
+/*
+  AVR boot loader communication library (Linux)
+
+  all state is in an avr_dev (one per serial port) and an img_map (shared read only),
+  so several controllers can be flashed at once with avr_batch()
+*/
+
+#ifndef LIBAVRBOOT_H
+#define LIBAVRBOOT_H
+
+#include <sys/time.h>
+
+#include "image.h"
+
+#define PACKED __attribute__((packed))
+
+#define CMD_MAXTIME 5000000
+#define CMD_RETRIES 3
+#define CONNECT_MAXTIME 30								// seconds avr_batch() waits for each AVR
+
+#define CMD_GET_SPM_PAGESIZE 0x0001
+#define CMD_READ_FLASH 0x0002
+#define CMD_READ_EE 0x0003
+#define CMD_WRITE_FLASH 0x0004
+#define CMD_WRITE_EE 0x0005
+#define CMD_RUN 0x0006
+#define CMD_CRC_FLASH 0x0007
+#define CMD_WRITE_FLASH_PIPE 0x0008
+#define CMD_WRITE_FLASH_RLE 0x0009
+#define CMD_OK 0x0100
+#define CMD_FAIL 0x0200
+
+#define CMD_HEADSIZE 6
+#define CMD_MINSIZE 8
+
+#define EE_CHUNK 128
+
+// serial command buffer
+typedef struct {
+	unsigned short command;
+	unsigned short address;
+	unsigned short nbytes;
+	unsigned char buffer[258];
+} PACKED command_buffer;
+
+// one AVR on one serial port
+typedef struct {
+	char name[64];									// prefix for messages ("" for none)
+	int fd;
+	int tty;
+	int vmin;										// termios VMIN now set
+	int verbose;									// message per page
+	int spm_ps;
+
+	// options (set after avr_open())
+	int baud;
+	int restart;
+	int program;
+	int verify;
+	int page_crc;									// skip pages whose CRC matches
+	int readback;									// verify by reading flash back
+	int pipe_write;									// pipelined page writes
+	int rle;										// RLE compressed page writes
+
+	// what the bootloader can do (cleared when it answers with an empty packet)
+	int crc_cmd;
+
+	// pipelined writes
+	int pipe_seq;
+	int pipe_pages;
+
+	// statistics
+	int pages_written;
+	int pages_skipped;
+	int bytes_raw;
+	int bytes_sent;
+	struct timeval t_start;
+	struct timeval t_done;
+	struct timeval t_begin;							// avr_batch() start
+	long connect_us;								// time to "OK"
+	int packets;									// round trip of each command and reply
+	long rtt_min;
+	long rtt_max;
+	long rtt_sum;
+
+	// request and reply
+	command_buffer cmd;
+	command_buffer rx;
+	int sent_command;
+	int sent_nbytes;
+	struct timeval t_sent;
+
+	// avr_batch() state
+	const img_map *img;
+	int state;
+	int result;
+	int page;
+	unsigned run_start;								// bytes with data, word aligned
+	unsigned run_end;
+	int retries;
+	int rx_pos;
+	int mon_sent;
+	struct timeval tx_time;							// next space or "MON"
+	struct timeval deadline;
+	char text[65];
+	int text_len;
+	int *todo;										// pages with data (-1 once the AVR has it)
+	int ntodo;
+	int todo_pos;
+} avr_dev;
+
+unsigned short crc_ccitt_update(unsigned short crc, unsigned char data);
+unsigned short calc_crc(unsigned char *buf, unsigned nbytes);
+int read_ihex(img_map *img, char *fname, int crc);
+int image_page(const img_map *img, int page, int spm_ps, char *buf);
+int rle_compress(unsigned char *src, int nbytes, unsigned char *dst);
+
+int avr_open(avr_dev *dev, char *devname);
+void avr_close(avr_dev *dev);
+void avr_msg(avr_dev *dev, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int avr_set_baud(avr_dev *dev, int rate);
+void avr_restart(avr_dev *dev);
+int avr_connect(avr_dev *dev);
+void avr_reset(avr_dev *dev);
+
+int avr_get_spm_pagesize(avr_dev *dev);
+int avr_read_flash_block(avr_dev *dev, int address, int nbytes, char *buf);
+int avr_read_ee_block(avr_dev *dev, int address, int nbytes, char *buf);
+int avr_write_flash_block(avr_dev *dev, int address, int nbytes, char *buf);
+int avr_write_ee_block(avr_dev *dev, int address, int nbytes, char *buf);
+int avr_crc_flash_block(avr_dev *dev, int address, int nbytes);
+
+int avr_read_ee(avr_dev *dev, char *buf, int nbytes);
+int avr_ee_backup(avr_dev *dev, char *fname, int eesize);
+int avr_ee_restore(avr_dev *dev, char *fname, int eesize);
+
+int avr_batch(avr_dev *devs, int ndev, const img_map *img);
+void avr_summary(avr_dev *dev);
+void avr_timing(avr_dev *dev);
+
+#endif
@@ -38,6 +38,15 @@ __SP_L__ = 0x3d
 __tmp_reg__ = 0
 __zero_reg__ = 1
 
+#ifdef SU_AUTOBAUD
+	.section .data
+
+	;starts at su_baud_delay, a byte more of .data is smaller than setting it in su_init
+	.global	su_baud
+su_baud:
+	.byte	su_baud_delay
+#endif
+
 	.text
 
 ;port definitions
@@ -76,8 +85,19 @@ __zero_reg__ = 1
 ;39 = 57600 at 14.746MHz
 ;124 = 19200 at 14.746MHz
 ;31 = 4800 at 1MHz
+;with SU_AUTOBAUD su_baud_delay is the baud rate until su_autobaud() has measured the host
 #define su_baud_delay 135
 
+#ifdef SU_AUTOBAUD
+;bit time is 6 * su_baud + 24 cycles (su_getchar), su_autobaud() rounds to nearest
+#define SU_BIT_OVERHEAD 21
+;tries at 24.6mS each, avrboot sends a space every 30mS
+#define SU_AUTOBAUD_TRIES 4
+;bit time limits in cycles (16MHz: 833 = 19200, 278 = 57600, 139 = 115200)
+#define SU_MIN_BIT 60
+#define SU_MAX_BIT 1500
+#endif
+
 ;for 1MHz
 ;#define SU_GETCHAR_TIMEOUT 1666
 ;for 8MHz
@@ -189,39 +209,71 @@ su_putchar2:
 	
 
 ; 0.5 bit delay at desired baud rate
-; overhead (call, load, untaken branch, return) is 9 cycles
+; overhead (call, load, untaken branch, return) is 9 cycles (10 with SU_AUTOBAUD)
 ; loop takes 3 cycles per iterration
 UART_delay:
+#ifdef SU_AUTOBAUD
+	lds		r31,su_baud
+#else
 	ldi		r31,su_baud_delay
+#endif
 UART_delay1:
 	dec		r31
 	brne	UART_delay1
 	ret
 
 
-#define wt_lobyte r24
-#define wt_hibyte r25
-
-	.global	su_waitpulse
-	.func	su_waitpulse
-su_waitpulse:
-	movw	r30,wt_lobyte
-su_waitpulse0:
-	sbis	su_PIN,su_RxD			;wait for edge of pulse
-	rjmp	su_waitpulse1			;got it
-	adiw	r30,1					;increment wait time
-	brne	su_waitpulse0			;keep waiting
-	movw	wt_lobyte,r30			;clear return value
-	ret								;and back to caller
-su_waitpulse1:						;leading edge of pulse
-	sbic	su_PIN,su_RxD			;wait for edge of pulse
-	rjmp	su_waitpulse2			;got it
-	adiw	wt_lobyte,1				;increment wait time
-	brne	su_waitpulse1			;keep waiting
-	ret								;and back to caller (with return value = 0)
-su_waitpulse2:
-	ret								;back to caller with actual time value
+#ifdef SU_AUTOBAUD
+#define bt_lobyte r24
+#define bt_hibyte r25
+#define ab_tries r18
+
+; measure the first space from avrboot and set su_baud from it
+; a space is low for 6 bits (start bit and five 0 bits) and the count is 6 cycles, so the count
+; is the bit time in cycles, su_baud = (bit time - SU_BIT_OVERHEAD) / 6
+; the rest of the measured space is lost, su_getchar() gets the next one
+; returns 0, or 20 if there was no pulse (all su_getchar() tries for the space are used up)
+	.global	su_autobaud
+	.func	su_autobaud
+su_autobaud:
+	ldi		ab_tries,SU_AUTOBAUD_TRIES
+su_autobaud0:
+	clr		bt_lobyte
+	clr		bt_hibyte
+	movw	r30,bt_lobyte
+su_autobaud1:
+	adiw	r30,1					;wait for the leading edge
+	breq	su_autobaud4			;timeout, next try
+	sbic	su_PIN,su_RxD
+	rjmp	su_autobaud1
+su_autobaud2:
+	adiw	bt_lobyte,1				;count the pulse
+	breq	su_autobaud4			;stuck low, next try
+	sbis	su_PIN,su_RxD
+	rjmp	su_autobaud2
+	sbiw	bt_lobyte,SU_MIN_BIT + 1
+	brcs	su_autobaud4			;too short
+	cpi		bt_lobyte,lo8(SU_MAX_BIT - SU_MIN_BIT - 1)
+	ldi		r19,hi8(SU_MAX_BIT - SU_MIN_BIT - 1)
+	cpc		bt_hibyte,r19
+	brcc	su_autobaud4			;too long
+	adiw	bt_lobyte,SU_MIN_BIT + 1 - SU_BIT_OVERHEAD - 6
+	clr		r31
+su_autobaud3:
+	inc		r31						;divide by 6
+	sbiw	bt_lobyte,6
+	brcc	su_autobaud3
+	sts		su_baud,r31
+	clr		r24						;wait for the next space
+	ret
+su_autobaud4:
+	dec		ab_tries
+	brne	su_autobaud0
+	ldi		r24,20					;no pulse, don't wait for a space
+	ret
 	.endfunc
 
-#undef wt_lobyte
-#undef wt_hibyte
+#undef bt_lobyte
+#undef bt_hibyte
+#undef ab_tries
+#endif
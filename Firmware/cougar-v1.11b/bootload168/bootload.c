@@ -16,7 +16,7 @@ Fran Sabolich
 #include <stdlib.h>
 #include <string.h>
 
-// now using automatically generated CRC file
+// program CRC is checked at start up (crc_address comes from the linker)
 #include "autocrc.h"
 
 // choose if we want EEprom support - comes at expense of less space for application
@@ -24,6 +24,12 @@ Fran Sabolich
 // program start address
 #define EE_SUPPORT
 
+// choose if we want pipelined flash writes (page is programmed while the next one comes in)
+#define PIPE_SUPPORT
+
+// choose if we want RLE compressed flash writes (needs PIPE_SUPPORT)
+#define RLE_SUPPORT
+
 #define PROGSTART 0x3800
 
 //#define T_WT 3000										// for 1MHz
@@ -37,9 +43,43 @@ Fran Sabolich
 #define CMD_WRITE_FLASH 0x0004
 #define CMD_WRITE_EE 0x0005
 #define CMD_RUN 0x0006
+#define CMD_CRC_FLASH 0x0007
+#define CMD_WRITE_FLASH_PIPE 0x0008
+#define CMD_WRITE_FLASH_RLE 0x0009
 #define CMD_OK 0x0100
 #define CMD_FAIL 0x0200
 
+// measure the baud rate of the first space from avrboot (19200 to 115200 at 16MHz)
+#define SU_AUTOBAUD
+#define SU_AUTOBAUD_TRIES 4								// 25mS each, avrboot sends a space every 30mS
+
+// go straight to the application after a brown-out or watchdog (crash) reset, or when RxD is idle
+// the "restart" command leaves BOOT_MAGIC at the top of SRAM so its watchdog reset waits for avrboot
+// reset to application at 16MHz, from cycle counts (not measured): brown-out or crash about 0.1mS,
+// idle RxD about 51mS (2mS CRC check and 49mS sample), 100mS without FAST_BOOT (autobaud tries)
+#define FAST_BOOT
+#define BOOT_MAGIC 0xb007
+
+// su_waitpulse() counts 6 cycles and a space is low for 6 bits (start bit and five 0 bits)
+// so the count is the bit time in cycles (16MHz: 833 = 19200, 278 = 57600, 139 = 115200)
+#define SU_MIN_BIT 60
+#define SU_MAX_BIT 1500
+
+// HW_UART (set in Makefile) uses the hardware USART in double speed mode on the software uart pins
+// an interrupt driven receive FIFO keeps bytes coming in while we wait for flash or EEprom
+#define HU_FIFO_SIZE 16									// power of 2
+#define HU_GETCHAR_TIMEOUT 156							// timer 1 counts (64uS at 16MHz) = 10mS like su_getchar()
+//#define HU_UBRR 95									// 19200 for 14.746MHz
+#define HU_UBRR 103										// 19200 for 16MHz
+
+// spm has to follow the write to SPMCSR within 4 cycles, so with the HW_UART receive interrupt
+// enabled each boot_page_xxx()/boot_rww_enable() runs with interrupts off (busy waits don't)
+#ifdef HW_UART
+#define SPM_ATOMIC(x) do { unsigned char sreg = SREG; cli(); x; SREG = sreg; } while (0)
+#else
+#define SPM_ATOMIC(x) x
+#endif
+
 #define CMD_HEADSIZE 6
 #define CMD_MINSIZE 8
 
@@ -55,18 +95,53 @@ void su_init(void);
 int su_getchar(void);
 void su_putchar(unsigned char);
 unsigned su_waitpulse(unsigned start_count);
+void su_autobaud(unsigned bit_time);
 void do_reboot(void);
 
 command_buffer cmd;
 
-// calc CRC for program (firmware)
-unsigned int calc_prog_crc(unsigned nbytes)
+#ifdef HW_UART
+unsigned char hu_fifo[HU_FIFO_SIZE];
+volatile unsigned char hu_head;
+unsigned char hu_tail;
+#endif
+
+#ifdef FAST_BOOT
+// reset cause and restart marker, read before anything is pushed on the stack
+unsigned char reset_flags __attribute__ ((section (".noinit")));
+unsigned boot_magic __attribute__ ((section (".noinit")));
+
+void get_reset_cause(void) __attribute__ ((naked)) __attribute__ ((section (".init3")));
+void get_reset_cause(void)
 {
-	unsigned n, crc;
+	reset_flags = MCUSR;
+	MCUSR = 0;
+	boot_magic = *(volatile unsigned *)(RAMEND - 1);
+	*(volatile unsigned *)(RAMEND - 1) = 0;
+}
+#endif
+
+#ifdef PIPE_SUPPORT
+unsigned char spm_state;								// 0 = idle, 1 = erasing, 2 = writing
+unsigned spm_page;
+unsigned char pipe_seq;									// sequence of last CMD_WRITE_FLASH_PIPE (host uses 1..15)
+unsigned pipe_pages;									// pages written by CMD_WRITE_FLASH_PIPE
+#endif
+#ifdef RLE_SUPPORT
+unsigned char page_buf[SPM_PAGESIZE];
+#endif
+
+// calc CRC for flash from address up to end (bootloader check and CMD_CRC_FLASH)
+// flash is read a word per loop (low byte first) - same result as the byte by byte CRC
+unsigned int calc_flash_crc(unsigned address, unsigned end)
+{
+	unsigned n, w, crc;
 	
 	crc = 0xffff;
-	for (n = PROGSTART; n < nbytes; n++) {
-		crc = _crc_ccitt_update (crc, pgm_read_byte(n));
+	for (n = address; n < end; n += 2) {
+		w = pgm_read_word(n);
+		crc = _crc_ccitt_update (crc, w & 0xff);
+		crc = _crc_ccitt_update (crc, w >> 8);
 	}
 	return(crc);
 }
@@ -91,6 +166,116 @@ void su_putbuf(char *buf, unsigned nbytes)
 	for (x = 0; x < nbytes; x++) su_putchar(*buf++);
 }
 
+#ifdef PIPE_SUPPORT
+// advance background page programming - called between received characters
+void spm_poll(void)
+{
+	if (spm_state && !boot_spm_busy()) {
+		if (spm_state == 1) {
+			// erase done - write page from the temporary buffer
+			SPM_ATOMIC(boot_page_write(spm_page));
+			spm_state = 2;
+		}
+		else {
+			// write done - application section readable again
+			SPM_ATOMIC(boot_rww_enable());
+			spm_state = 0;
+		}
+	}
+}
+
+// wait for background page programming
+void spm_finish(void)
+{
+	while (spm_state) spm_poll();
+}
+#endif
+
+#ifdef HW_UART
+// USART receive interrupt - byte into FIFO (dropped if FIFO full)
+ISR(USART_RX_vect)
+{
+	unsigned char c, i;
+
+	c = UDR0;
+	i = (hu_head + 1) & (HU_FIFO_SIZE - 1);
+	if (i != hu_tail) {
+		hu_fifo[hu_head] = c;
+		hu_head = i;
+	}
+}
+
+// hardware USART replacements for the software uart in misc.asm
+void su_init(void)
+{
+	// interrupt vectors to the boot section (application section can't be read while it is written)
+	MCUCR = (1 << IVCE);
+	MCUCR = (1 << IVSEL);
+	UBRR0 = HU_UBRR;
+	UCSR0A = (1 << U2X0);
+	UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
+	UCSR0B = (1 << RXCIE0) | (1 << RXEN0) | (1 << TXEN0);
+	// timer 1 at clk/1024 for su_getchar() timeout
+	TCCR1A = 0;
+	TCCR1B = (1 << CS12) | (1 << CS10);
+	sei();
+}
+
+// get char from FIFO (-1 after 10mS without one)
+int su_getchar(void)
+{
+	unsigned char c;
+	unsigned t;
+
+	t = TCNT1;
+	while (hu_head == hu_tail) {
+		if ((unsigned)(TCNT1 - t) > HU_GETCHAR_TIMEOUT) return(-1);
+	}
+	c = hu_fifo[hu_tail];
+	hu_tail = (hu_tail + 1) & (HU_FIFO_SIZE - 1);
+	return(c);
+}
+
+void su_putchar(unsigned char c)
+{
+	while (!(UCSR0A & (1 << UDRE0)));
+	UDR0 = c;
+}
+
+// set baud rate from bit time in cycles (su_waitpulse()), double speed UBRR rounded to nearest
+void su_autobaud(unsigned bit_time)
+{
+	UBRR0 = ((bit_time + 4) >> 3) - 1;
+}
+#endif
+
+#ifdef RLE_SUPPORT
+// expand RLE data into a flash page, return number of bytes (page size if ok)
+// control byte n < 128: n + 1 bytes follow as is, n >= 128: next byte repeated n - 125 times
+unsigned rle_expand(unsigned char *dst, unsigned char *src, unsigned nbytes)
+{
+	unsigned char n, c, rep;
+	unsigned i;
+	unsigned char *end;
+
+	i = 0; c = 0; end = src + nbytes;
+	while (src < end) {
+		n = *src++;
+		rep = n & 0x80;
+		if (rep) {
+			n -= 125;
+			c = *src++;
+		}
+		else n++;
+		while (n--) {
+			if (i >= SPM_PAGESIZE) return(0);
+			dst[i++] = rep ? c : *src++;
+		}
+	}
+	return(i);
+}
+#endif
+
 // get bytes from software uart (with timeout)
 unsigned su_getbuf(char *buf, unsigned maxbytes)
 {
@@ -99,6 +284,9 @@ unsigned su_getbuf(char *buf, unsigned maxbytes)
 	
 	nb = 0;
 	while (nb < maxbytes) {
+		#ifdef PIPE_SUPPORT
+		spm_poll();
+		#endif
 		x = su_getchar();
 		if (x < 0) break;
 		*buf++ = x;
@@ -113,7 +301,7 @@ void program_flash_page(unsigned page, unsigned char *buf)
 	unsigned i, w;
 
 	// erase page
-    boot_page_erase(page);
+    SPM_ATOMIC(boot_page_erase(page));
 	boot_spm_busy_wait();
 	eeprom_busy_wait();
 	// fill buffer
@@ -121,15 +309,35 @@ void program_flash_page(unsigned page, unsigned char *buf)
 		// Set up little-endian word.
 		w = *buf++;
 		w |= (*buf++) << 8;
-		boot_page_fill((unsigned long)(page + i), w);
+		SPM_ATOMIC(boot_page_fill((unsigned long)(page + i), w));
 	}
 	// write buffer to page
-	boot_page_write(page);
+	SPM_ATOMIC(boot_page_write(page));
 	boot_spm_busy_wait();
 	// Reenable RWW-section again. We need this if we want to jump back
 	// to the application after bootloading.
-	boot_rww_enable();
+	SPM_ATOMIC(boot_rww_enable());
+}
+
+#ifdef PIPE_SUPPORT
+// start programming flash page, spm_poll() finishes it
+// the temporary buffer is filled before the erase so buf is free when this returns
+void program_flash_start(unsigned page, unsigned char *buf)
+{
+	unsigned i, w;
+
+	eeprom_busy_wait();
+	for (i=0; i<SPM_PAGESIZE; i+=2) {
+		w = *buf++;
+		w |= (*buf++) << 8;
+		SPM_ATOMIC(boot_page_fill((unsigned long)(page + i), w));
+	}
+	// application section is RWW - we keep running while it erases
+	SPM_ATOMIC(boot_page_erase(page));
+	spm_page = page;
+	spm_state = 1;
 }
+#endif
 
 // listen to master
 void be_slave(void)
@@ -144,6 +352,9 @@ void be_slave(void)
 			z = *(unsigned *)(((char *)&cmd) + (x - 2));
 			if (z == y) {
 				// command packet with good CRC
+				#ifdef PIPE_SUPPORT
+				spm_finish();
+				#endif
 				y = 0;
 				switch ((unsigned char)cmd.command) {
 					case CMD_GET_SPM_PAGESIZE:
@@ -162,6 +373,36 @@ void be_slave(void)
 							}
 						}
 						break;
+					case CMD_CRC_FLASH:
+						// nbytes in the reply is 2 (old bootloaders echo the request)
+						*(unsigned *)cmd.buffer = calc_flash_crc(cmd.address, cmd.address + cmd.nbytes);
+						cmd.nbytes = y = 2;
+						break;
+					#ifdef RLE_SUPPORT
+					case CMD_WRITE_FLASH_RLE:
+						// expand the page and carry on as CMD_WRITE_FLASH_PIPE
+						cmd.nbytes = rle_expand(page_buf, cmd.buffer, cmd.nbytes);
+						memcpy(cmd.buffer, page_buf, SPM_PAGESIZE);
+						// fall through
+					#endif
+					#ifdef PIPE_SUPPORT
+					case CMD_WRITE_FLASH_PIPE:
+						// sequence in bits 12-15, a repeated one (lost reply) is only answered again
+						x = cmd.command >> 12;
+						if (x != pipe_seq) {
+							pipe_seq = x;
+							if (cmd.nbytes == SPM_PAGESIZE) {
+								if (cmd.address <= ((unsigned)PROGSTART - (unsigned)SPM_PAGESIZE)) {
+									program_flash_start(cmd.address, cmd.buffer);
+									pipe_pages++;
+								}
+							}
+						}
+						// reply is the number of pages written so far (nbytes 2 like CMD_CRC_FLASH)
+						*(unsigned *)cmd.buffer = pipe_pages;
+						cmd.nbytes = y = 2;
+						break;
+					#endif
 					case CMD_RUN:
 						return;
 					#ifdef EE_SUPPORT	
@@ -170,7 +411,12 @@ void be_slave(void)
 						eeprom_read_block(cmd.buffer, (void *)cmd.address, y);
 						break;
 					case CMD_WRITE_EE:
-						eeprom_write_block(cmd.buffer, (void *)cmd.address, cmd.nbytes);
+						// only bytes that changed are written (3.4mS and one erase/write cycle each)
+						for (x = 0; x < cmd.nbytes; x++) {
+							if (eeprom_read_byte((uint8_t *)(cmd.address + x)) != cmd.buffer[x]) {
+								eeprom_write_byte((uint8_t *)(cmd.address + x), cmd.buffer[x]);
+							}
+						}
 						break;
 					#endif
 				}
@@ -188,6 +434,9 @@ int main(void)
 {
 	unsigned char lp, rv;
 	char str[32];
+#ifdef SU_AUTOBAUD
+	unsigned x, y;
+#endif
 		
 	asm ("cli");
 	asm ("wdr");
@@ -195,18 +444,46 @@ int main(void)
 	WDTCSR |= (1 << WDCE) | (1 << WDE);
 	WDTCSR = 0x00;
 
+#ifdef FAST_BOOT
+	// power on and reset button get the full handshake window
+	if (!(reset_flags & (1 << PORF))) {
+		if (reset_flags & (1 << BORF)) do_reboot();
+		if ((reset_flags & (1 << WDRF)) && (boot_magic != BOOT_MAGIC)) do_reboot();
+	}
+#endif
+
 #ifdef crc_address
 	unsigned crc1, crc2;
 	
 	crc1 = pgm_read_word(crc_address);		// read program CRC
-	crc2 = calc_prog_crc(crc_address);		// read program CRC
+	crc2 = calc_flash_crc(PROGSTART, crc_address);	// calc program CRC
 	if (crc1 != crc2) {
 		// program CRC error
 		do_reboot();						// attempt to start application code
 	}
+#endif
+#ifdef FAST_BOOT
+	// avrboot sends a space every 30mS, RxD at mark (no start edge) for two su_waitpulse()
+	// timeouts (24.6mS each) means no host, the handshake only waits when there is one
+	if (!su_waitpulse(0) && !su_waitpulse(0)) do_reboot();
 #endif
 	su_init();
-	lp = 0; rv = 1;
+	rv = 1;
+#ifdef SU_AUTOBAUD
+	lp = 20;								// no pulse - don't wait for a space
+	for (x = 0; x < SU_AUTOBAUD_TRIES; x++) {
+		// su_waitpulse() times out after 25mS
+		y = su_waitpulse(0);
+		if ((y > SU_MIN_BIT) && (y < SU_MAX_BIT)) {
+			// set baud rate, rest of this space is lost, wait for the next one
+			su_autobaud(y);
+			lp = 0;
+			break;
+		}
+	}
+#else
+	lp = 0;
+#endif
 	while (lp++ < 20) {
 		if (su_getchar() == ' ') {
 			// got space character - probably bootloader
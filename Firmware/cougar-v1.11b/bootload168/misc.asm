@@ -38,12 +38,30 @@ __SP_L__ = 0x3d
 __tmp_reg__ = 0
 __zero_reg__ = 1
 
+#ifndef HW_UART
+	.section .bss
+
+	.global	su_baud
+su_baud:
+	.skip	1
+#endif
+
 	.text
 
 ;port definitions
 #define PIND 0x09
 #define DDRD 0x0A
 #define PORTD 0x0B
+#define MCUCR 0x35
+#define IVCE 0
+#define TCCR1B 0x81
+#define UCSR0A 0xC0
+#define UCSR0B 0xC1
+#define UBRR0L 0xC4
+#define UBRR0H 0xC5
+#define TCNT1L 0x84
+#define TCNT1H 0x85
+#define TIFR1 0x16
 
 
 ;software uart input PORT
@@ -76,8 +94,12 @@ __zero_reg__ = 1
 ;39 = 57600 at 14.746MHz
 ;124 = 19200 at 14.746MHz
 ;31 = 4800 at 1MHz
+;su_baud_delay is the baud rate until su_autobaud() has measured the host
 #define su_baud_delay 135
 
+;bit time is 6 * su_baud + 24 cycles (su_getchar), su_autobaud() rounds to nearest
+#define SU_BIT_OVERHEAD 21
+
 ;for 1MHz
 ;#define SU_GETCHAR_TIMEOUT 1666
 ;for 8MHz
@@ -87,6 +109,8 @@ __zero_reg__ = 1
 ;for 16MHz
 #define SU_GETCHAR_TIMEOUT 26655
 
+;with HW_UART the uart routines are in bootload.c (hardware USART on the same pins)
+#ifndef HW_UART
 	.global	su_init
 	.func	su_init
 su_init:
@@ -96,6 +120,9 @@ su_init:
 	sbi		su_PORT,su_TxD
 	sbi		su_TxD_ddr,su_TxD
 	sbi		su_PORT,su_TxD
+	; default baud rate (set in code so .data doesn't need copying)
+	ldi		r24,su_baud_delay
+	sts		su_baud,r24
 	; Tx Enable to output and high - not needed if TTL<->RS232 chip always enabled
 	;sbi		su_EN_PORT,su_EN
 	;sbi		su_EN_ddr,su_EN
@@ -103,6 +130,7 @@ su_init:
 	; done, back to caller
 	ret
 	.endfunc
+#endif
 
 
 	.global	do_reboot
@@ -112,6 +140,24 @@ do_reboot:
 	;cbi		su_EN_ddr,su_EN
 	; Tx back to input
 	cbi		su_TxD_ddr,su_TxD
+#ifdef HW_UART
+	; USART and timer 1 back to their reset values (the application may not set all of them),
+	; interrupt vectors back to the application (UCSR0C and TCCR1A are already at reset values)
+	cli
+	clr		r24
+	sts		UCSR0B,r24
+	sts		UCSR0A,r24
+	sts		UBRR0H,r24
+	sts		UBRR0L,r24
+	sts		TCCR1B,r24
+	sts		TCNT1H,r24
+	sts		TCNT1L,r24
+	ldi		r25,0x27
+	out		TIFR1,r25
+	ldi		r25,(1 << IVCE)
+	out		MCUCR,r25
+	out		MCUCR,r24
+#endif
 	; and jump to application code
 	clr		r30
 	clr		r31
@@ -119,6 +165,7 @@ do_reboot:
 	.endfunc
 
 
+#ifndef HW_UART
 #define su_bitcnt r30
 #define su_rxbyte r24
 #define su_hibyte r25
@@ -189,16 +236,39 @@ su_putchar2:
 	
 
 ; 0.5 bit delay at desired baud rate
-; overhead (call, load, untaken branch, return) is 9 cycles
+; overhead (call, load, untaken branch, return) is 10 cycles
 ; loop takes 3 cycles per iterration
 UART_delay:
-	ldi		r31,su_baud_delay
+	lds		r31,su_baud
 UART_delay1:
 	dec		r31
 	brne	UART_delay1
 	ret
 
 
+#define bt_lobyte r24
+#define bt_hibyte r25
+
+; set su_baud from bit time in cycles (r25:r24, su_waitpulse() count of a 6 bit low pulse)
+; su_baud = (bit time - SU_BIT_OVERHEAD) / 6, bit time must be > SU_BIT_OVERHEAD + 6
+	.global	su_autobaud
+	.func	su_autobaud
+su_autobaud:
+	sbiw	bt_lobyte,SU_BIT_OVERHEAD + 6
+	clr		r31
+su_autobaud1:
+	inc		r31						;divide by 6
+	sbiw	bt_lobyte,6
+	brcc	su_autobaud1
+	sts		su_baud,r31
+	ret
+	.endfunc
+
+#undef bt_lobyte
+#undef bt_hibyte
+#endif
+
+
 #define wt_lobyte r24
 #define wt_hibyte r25
 
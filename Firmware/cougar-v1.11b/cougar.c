@@ -27,6 +27,27 @@ version 1.10 - added configurable PWM dead zone and motor overspeed detect time
 version 1.11 - added motor_speed_calc_amps - attempt to avoid overspeed tripping when pedal is "pumped"
                (code no longer fits in ATMega8 with CRC check enabled)
 version 1.11b - slight change to "motor_speed_calc_amps" logic; see line 469
+version 1.12 - added configuration transactions ("begin", "commit", "abort") so several parameters
+               can be changed together and swapped into the PI loop at once
+               "save" writes EEprom from the EE ready interrupt (eewrite.c), watchdog stays enabled
+               battery_ah saved once a minute to a wear levelled ring in EEprom, restored at power up
+               config copies have a generation counter, boot loads the newest good copy and stops,
+               stale or bad copies are repaired in the background once PWM is running ("boot-time")
+               program CRC check reads flash a word at a time, time it takes is shown by "boot-time"
+               start up phases are timestamped ("boot-timeline" replaces "boot-time"), the precharge
+               wait is counted from when the time base starts, so start up overlaps the precharge,
+               serial port and menu are set up while the voltages settle for Vref
+               continuous CPU load monitor ("load"), "idle" no longer stops the main loop for 100mS
+               pi_loop() publishes a coherent real time data snapshot (double buffer with sequence)
+               fault events are logged to EE prom with a snapshot of the controller state ("faults")
+               second gain set (Kp, Ki, ramp rate, throttle gains), switched by "gain-set" or on
+               ocr1a_lpf ("gain-sw-lpf"), spares used up so config (and battery_ah) reset to defaults
+               gain schedule, Kp and Ki interpolated over ocr1a_lpf ("gain-sched", "gs-kpN", "gs-kiN"),
+               3 config copies and 12 battery_ah slots to make room in EE prom
+               "restart" marks its watchdog reset for the bootloader, which goes straight to the
+               application after a brown-out or a watchdog (crash) reset
+               ATMega8 no longer supported - the code doesn't fit below its bootloader (0x1C00),
+               the v1.11b images in hexfiles-m8 are the last ATMega8 builds
 
 Copy either "Makefile.Linux" or "Makefile.Windows" to "Makefile"
 For size optimizations (smallest code) use -Os for CPFLAGS in Makefile
@@ -34,33 +55,30 @@ For speed optimizations (fastest code) use -O2 for CPFLAGS in Makefile
 In Makefile set serial port (first parameter after "avrboot") for your system
 */
 
-#ifdef __AVR_ATmega168__
-#define MEGA168
+// since version 1.12 the application needs more than the 7K the ATMega8 has below its bootloader
+#ifndef __AVR_ATmega168__
+#error "ATMega8 no longer supported (use the v1.11b hexfiles-m8 images)"
 #endif
 
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
-#ifdef MEGA168
 #include <avr/iom168.h>
-#else
-#include <avr/iom8.h>
-#endif
 #include <util/crc16.h>
 #include <avr/wdt.h>
 #include <avr/eeprom.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "cougar.h"
 
-#ifdef MEGA168
 #define TIMSK TIMSK1
 #define TICIE1 ICIE1
-#endif
+#define TCCR0 TCCR0B
 
-// if AUTOCRC is defined, use automatically generated CRC file
+// if AUTOCRC is defined, check the program CRC (crc_address comes from the linker)
 #ifdef AUTOCRC
 #include "autocrc.h"
 #endif
@@ -73,16 +91,30 @@ typedef struct {
 	unsigned raw_throttle;
 	unsigned battery_amps;
 	unsigned long battery_ah;
+	unsigned pwm;						// OCR1A (0 to 510)
+	unsigned char fault_bits;
 } realtime_data_type;
 
 typedef struct {
-	long K1;
-	long K2;
 	long error_new;
 	long error_old;
 	long pwm;
+	long sched_K1;						// K1 from gain schedule at ocr1a_lpf
+	long sched_K2;						// K2 from gain schedule at ocr1a_lpf
 } pi_storage_type;
 
+// everything pi_loop() needs from one gain set, calculated from config by config_pi()
+typedef struct {
+	long K1;							// Kp << 10
+	long K2;							// Ki - K1
+	unsigned throttle_pos_gain;
+	unsigned throttle_pwm_gain;
+	int current_ramp_rate;
+} gain_set_type;
+
+#define GAIN_SETS 2
+#define GAIN_AUTO GAIN_SETS				// gain_mode for switching on ocr1a_lpf
+
 typedef struct {
 	unsigned magic;						// must be 0x12ab
 	int Kp;								// PI loop proportional gain
@@ -102,10 +134,53 @@ typedef struct {
 	unsigned battery_amps_limit;		// battery amps limit
 	unsigned precharge_time;			// precharge time in 0.1 second increments
 	unsigned motor_sc_amps;				// motor current must be > motor_sc_amps to calculate motor speed
-	unsigned spares[5];					// space for future use
+	unsigned gen;						// generation, incremented each time config is saved
+	int Kp2;							// gain set 2 - PI loop proportional gain
+	int Ki2;							// gain set 2 - PI loop integral gain
+	unsigned throttle_pos_gain2;		// gain set 2 - gain for actual throttle position
+	unsigned throttle_pwm_gain2;		// gain set 2 - gain for pwm (voltage)
+	int current_ramp_rate2;				// gain set 2 - current ramp rate
+	unsigned gain_switch_lpf;			// use gain set 2 above this ocr1a_lpf (0 for never)
+	unsigned gain_sched;				// 1 to take Kp and Ki from the gain schedule
+	int gs_Kp[GS_POINTS];				// gain schedule Kp at ocr1a_lpf 0, 128, 256, 384, 512
+	int gs_Ki[GS_POINTS];				// gain schedule Ki at ocr1a_lpf 0, 128, 256, 384, 512
 	unsigned crc;						// checksum for verification
 } config_type;
 
+typedef struct {
+	unsigned seq;						// sequence number, newest slot has the highest
+	unsigned long battery_ah;			// saved battery_ah
+	unsigned crc;						// checksum for verification
+} ah_slot_type;
+
+// battery_ah slots start right after the config copies
+#define EE_AH_ADDRESS (EE_CONFIG_ADDRESS + (EE_CONFIG_COPIES * sizeof(config_type)))
+
+typedef struct {
+	unsigned seq;						// sequence number, newest entry has the highest
+	unsigned long uptime;				// 0.1 second units since power up
+	unsigned char fault_bits;			// fault bits after the event
+	unsigned char changed;				// fault bits that were set or cleared
+	int current_ref;
+	int current_fb;
+	unsigned pwm;						// OCR1A (0 to 510)
+	unsigned raw_hs_temp;
+	unsigned raw_throttle;
+	unsigned crc;						// checksum for verification
+} fault_log_type;
+
+// fault log entries start right after the battery_ah slots
+#define EE_LOG_ADDRESS (EE_AH_ADDRESS + (EE_AH_SLOTS * sizeof(ah_slot_type)))
+
+// everything must fit in EE prom - the array size is -1 (compile error) if it doesn't
+typedef char ee_layout_check[((EE_LOG_ADDRESS + (EE_LOG_ENTRIES * sizeof(fault_log_type))) <= (E2END + 1)) ? 1 : -1];
+
+typedef struct {
+	unsigned char active;				// 1 if a transaction was started with "begin"
+	unsigned mask;						// show_config() mask of parameters changed in transaction
+	config_type config;					// staged copy of config, applied by "commit"
+} config_tx_type;
+
 config_type default_config PROGMEM = {
 	0x12ab,								// magic
 	2,									// PI loop P gain (Joe's was 1)
@@ -125,7 +200,16 @@ config_type default_config PROGMEM = {
 	0,									// battery amps limit
 	0,									// precharge time
 	0,									// motor speed calc amps
-	{0,0,0,0,0},						// 5 spares
+	0,									// generation
+	2,									// gain set 2 - PI loop P gain
+	160,								// gain set 2 - PI loop I gain
+	8,									// gain set 2 - throttle pedal position gain
+	0,									// gain set 2 - throttle pwm (voltage) gain
+	6,									// gain set 2 - current ramp rate
+	0,									// gain switch ocr1a_lpf (automatic switching off)
+	0,									// gain schedule off
+	{2, 2, 2, 2, 2},					// gain schedule P gains
+	{160, 160, 160, 160, 160},			// gain schedule I gains
 	0									// crc
 };
 
@@ -155,6 +239,18 @@ int current_fb = 0;						// current feedback (actual current)
 unsigned battery_amps = 0;				// calculated battery current
 unsigned long battery_ah = 0;			// calculated battery AH used by controller
 
+ah_slot_type ah_slot;					// newest battery_ah slot (also buffer for writing it)
+unsigned char ah_slot_index = EE_AH_SLOTS - 1;	// EE prom slot ah_slot belongs to
+volatile unsigned char ah_slot_done = 1;		// set by EEprom writer when ah_slot written
+unsigned ah_save_timer = 0;				// 0.1 second units since battery_ah last saved
+
+fault_log_type fault_log;				// fault event (also buffer for writing it)
+unsigned fault_log_seq = 0;				// sequence number of newest fault log entry
+unsigned char fault_log_index = EE_LOG_ENTRIES - 1;	// EE prom entry of newest fault event
+volatile unsigned char fault_log_ready = 0;	// set by pi_loop() when fault_log holds a new event
+volatile unsigned char fault_log_done = 1;	// set by EEprom writer when fault_log written
+unsigned long uptime = 0;				// 0.1 second units since power up
+
 unsigned long bat_amp_lim_510 = 0;		// battery amps limit multiplied by 510 (max PWM)
 
 unsigned long motor_overspeed_threshold = 0;	// motor overspeed threshold
@@ -166,25 +262,60 @@ unsigned precharge_timer = 0;			// precharge timer in 0.1 second units
 unsigned throttle_fault_counts = 0;
 volatile unsigned char fault_bits = HPL_FAULT;
 
-unsigned long idle_loopcount;			// how many loops we do while micro is not executing PI
+volatile unsigned load_ticks[LOAD_SOURCES];	// ISR busy time in this window (4uS units)
+volatile unsigned load_all = 0;			// busy time of all ISRs (to subtract nested ISRs)
+unsigned load_win[LOAD_SOURCES];		// ISR busy time in last full window
+unsigned load_peak[LOAD_SOURCES];		// highest window since last "load" command
+unsigned main_loops = 0;				// main loop passes in this window
+unsigned main_loops_win = 0;			// main loop passes in last full window
 
 unsigned tm_show_data;					// timer for realtime data display
+unsigned tm_crc = 0;					// time program CRC check took (64uS units)
+
+// start up phases, boot_time[] is the time (mS since time base started) each phase was done
+#define BT_CONFIG 0						// config and battery amp hours read from EEprom
+#define BT_UART 1						// serial port running, menu shown
+#define BT_SETTLE 2						// voltages settled (for Vref)
+#define BT_VREF 3						// Vref measured
+#define BT_PWM 4						// PWM running
+#define BT_PRECHARGE 5					// precharge wait over
+#define BT_READY 6						// no faults - ready to drive
+#define BT_PHASES 7
+
+unsigned boot_time[BT_PHASES] = {0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff};
+
+char boot_phase_names[BT_PHASES][10] PROGMEM = {
+	"config", "uart", "settle", "vref", "pwm", "precharge", "ready"
+};
 
 char uart_str[80];						// string for uart_putstr()
 
 pi_storage_type pi;
+gain_set_type gain_set[GAIN_SETS];
+gain_set_type * volatile gains = &gain_set[0];	// gain set used by pi_loop()
+unsigned char gain_mode = GAIN_AUTO;	// gain set number, or GAIN_AUTO to switch on ocr1a_lpf
 config_type config;
-realtime_data_type rt_data;
+config_type ee_config;					// copy of config being written to EEprom
+volatile unsigned char ee_config_done;	// set by EEprom writer when last copy written
+unsigned char ee_config_busy = 0;		// copies of ee_config being written (write_config() copies), 0 when done
+config_tx_type tx;
+realtime_data_type rt_data;			// main loop copy of real time data
+realtime_data_type rt_buf[2];			// written by pi_loop(), rt_buf[rt_seq & 1] is the newest
+volatile unsigned char rt_seq = 0;		// incremented by pi_loop() each time rt_buf is written
 
 #ifdef crc_address
 // calc CRC for program (firmware)
+// flash is read a word (two bytes) per loop, low byte first, so the result is the same as the
+// byte by byte CRC calculated by hexmerge and avrboot - nbytes (crc_address) is always even
 unsigned int calc_prog_crc(unsigned nbytes)
 {
-	unsigned n, crc;
+	unsigned n, w, crc;
 	
 	crc = 0xffff;
-	for (n = PROGSTART; n < nbytes; n++) {
-		crc = _crc_ccitt_update (crc, pgm_read_byte(n));
+	for (n = PROGSTART; n < nbytes; n += 2) {
+		w = pgm_read_word(n);
+		crc = _crc_ccitt_update (crc, w & 0xff);
+		crc = _crc_ccitt_update (crc, w >> 8);
 	}
 	return(crc);
 }
@@ -202,7 +333,6 @@ unsigned int calc_block_crc(unsigned nbytes, unsigned char *buf)
 	return(crc);
 }
 
-#ifdef MEGA168
 void watchdog_disable(void)
 {
 	asm ("cli");
@@ -220,18 +350,6 @@ void watchdog_enable(void)
 	WDTCSR = (1 << WDE) | (1 << WDP2);
 	asm ("sei");
 }
-#else
-void watchdog_disable(void)
-{
-	wdt_reset();
-	wdt_disable();
-}
-void watchdog_enable(void)
-{
-	wdt_reset();
-	wdt_enable(WDTO_250MS);
-}
-#endif
 
 // convert val to string (inside body of string) with specified number of digits
 // do NOT terminate string
@@ -300,13 +418,20 @@ unsigned long wait_time(unsigned howlong)
 void pi_loop(void)
 {
 	static unsigned char throttle_counter = 0;
-	unsigned loc_current_fb, loc_throttle;
+	static unsigned char logged_faults = 0;
+	static int ba_current_fb = 0;			// current_fb and pwm battery_amps was calculated from
+	static unsigned ba_pwm = 0;
+	unsigned loc_current_fb, loc_throttle, loc_hs_temp, loc_raw_throttle;
 	unsigned uv1, uv2;
 	unsigned long luv1;
 	int i;
+	realtime_data_type *rt;
+	gain_set_type *g;
 		
 	loc_current_fb = raw_current_fb;
-	loc_throttle = raw_throttle;
+	loc_throttle = loc_raw_throttle = raw_throttle;
+	loc_hs_temp = raw_hs_temp;
+	g = gains;
 	sei();
 	// now we have a snapshot of all ADC readings and interrupts are enabled
 	// the timer 1 overflow ISR should re-enter on itself if it needs to
@@ -335,7 +460,9 @@ void pi_loop(void)
 		// so we don't need to run the PI loop, just set error_old to error_new
 	}
 	else {
-		pi.pwm += (pi.K1 * pi.error_new) + (pi.K2 * pi.error_old);
+		// velocity form - a new gain set only changes the next step, not pi.pwm (bumpless)
+		if (config.gain_sched) pi.pwm += (pi.sched_K1 * pi.error_new) + (pi.sched_K2 * pi.error_old);
+		else pi.pwm += (g->K1 * pi.error_new) + (g->K2 * pi.error_old);
 	}
 	pi.error_old = pi.error_new;
 	if (pi.pwm > (510L << 16)) pi.pwm = (510L << 16);
@@ -405,16 +532,25 @@ void pi_loop(void)
 	}
 	else if ((throttle_counter & 0x03) == 0x01) {
 		// run throttle logic at 1KHz, calculate current_ref from throttle_ref
+		// automatic gain set switching (with hysteresis), used from the next PI loop on
+		// gain_switch_lpf 0 never switches, that is gain set 1
+		if (gain_mode == GAIN_AUTO) {
+			if (config.gain_switch_lpf == 0) g = &gain_set[0];
+			else if (ocr1a_lpf > config.gain_switch_lpf + GAIN_SWITCH_HYST) g = &gain_set[1];
+			else if (ocr1a_lpf + GAIN_SWITCH_HYST < config.gain_switch_lpf) g = &gain_set[0];
+			gains = g;
+		}
 		// throttle gain logic
-		uv1 = ((unsigned)throttle_ref * config.throttle_pos_gain) >> 3;
-		uv2 = (ocr1a_lpf * config.throttle_pwm_gain) >> 3;
+		uv1 = ((unsigned)throttle_ref * g->throttle_pos_gain) >> 3;
+		uv2 = (ocr1a_lpf * g->throttle_pwm_gain) >> 3;
 		if (uv1 > uv2) loc_throttle = uv1 - uv2;
 		else loc_throttle = 0;
 		// current_ref ramp rate logic
 		if (loc_throttle > max_current_ref) i = (max_current_ref - current_ref);
 		else i = (int)loc_throttle - current_ref;
-		if (i > config.current_ramp_rate) i = config.current_ramp_rate;
-		else if (i < -config.current_ramp_rate) i = -config.current_ramp_rate;
+		// the ramp rate also keeps a change of throttle gains from stepping current_ref
+		if (i > g->current_ramp_rate) i = g->current_ramp_rate;
+		else if (i < -g->current_ramp_rate) i = -g->current_ramp_rate;
 		current_ref += i;
 		// to limit battery amps, limit motor amps based on PWM (with low pass filter)
 		if (config.battery_amps_limit > 0) {
@@ -434,7 +570,10 @@ void pi_loop(void)
 	else if ((throttle_counter & 0x03) == 0x02) {
 		// run battery amps and hours logic at 1KHz
 		// battery_amps = (current_fb * pwm) / 512;
-		battery_amps = ((unsigned long)current_fb * (unsigned long)ocr1a_ghost) >> 8;
+		// current_fb and pwm are kept for the real time data, so it shows what battery_amps came from
+		ba_current_fb = current_fb;
+		ba_pwm = ocr1a_ghost;
+		battery_amps = ((unsigned long)ba_current_fb * (unsigned long)ba_pwm) >> 8;
 		if (battery_amps & 0x0001) battery_amps = (battery_amps >> 1) + 1;
 		else battery_amps = battery_amps >> 1;
 		// current_fb of 505 counts equals 500 motor amps
@@ -444,6 +583,16 @@ void pi_loop(void)
 		// now we've added battery_amps to the battery amp hour sum
 		if (battery_ah > (unsigned long)4000000000UL) battery_ah = (unsigned long)4000000000UL;
 		// clamp to 4E9 to prevent roll-over
+
+		// gain schedule - interpolate Kp and Ki between the two points around ocr1a_lpf
+		// points are 128 counts apart, so shifts instead of divides (K1 = Kp << 10)
+		uv1 = ocr1a_lpf >> GS_SHIFT;
+		if (uv1 > GS_POINTS - 2) uv1 = GS_POINTS - 2;
+		i = ocr1a_lpf - (uv1 << GS_SHIFT);
+		pi.sched_K1 = ((long)config.gs_Kp[uv1] << 10) +
+			((long)(config.gs_Kp[uv1 + 1] - config.gs_Kp[uv1]) * i * (1 << (10 - GS_SHIFT)));
+		pi.sched_K2 = (long)config.gs_Ki[uv1] +
+			(((long)(config.gs_Ki[uv1 + 1] - config.gs_Ki[uv1]) * i) >> GS_SHIFT) - pi.sched_K1;
 	}
 	else if ((throttle_counter & 0x03) == 0x03) {
 		// run motor overspeed logic at 1KHz
@@ -491,6 +640,32 @@ void pi_loop(void)
 				else motor_os_count = 0;
 			}
 		}
+		// all four 1KHz steps done - publish real time data to the buffer nobody is reading
+		rt = &rt_buf[(rt_seq + 1) & 0x01];
+		rt->throttle_ref = throttle_ref;
+		rt->current_ref = current_ref;
+		rt->current_fb = ba_current_fb;
+		rt->raw_hs_temp = loc_hs_temp;
+		rt->raw_throttle = loc_raw_throttle;
+		rt->battery_amps = battery_amps;
+		rt->battery_ah = battery_ah;
+		rt->pwm = ba_pwm;
+		rt->fault_bits = fault_bits;
+		asm volatile ("" ::: "memory");		// buffer must be written before rt_seq changes
+		rt_seq++;
+		// capture logged fault bits changes, main loop writes them to EE prom
+		// if the last event is still being written, try again next time
+		if (((fault_bits ^ logged_faults) & LOG_FAULTS) && fault_log_done && !fault_log_ready) {
+			fault_log.fault_bits = fault_bits;
+			fault_log.changed = (fault_bits ^ logged_faults) & LOG_FAULTS;
+			fault_log.current_ref = rt->current_ref;
+			fault_log.current_fb = rt->current_fb;
+			fault_log.pwm = rt->pwm;
+			fault_log.raw_hs_temp = rt->raw_hs_temp;
+			fault_log.raw_throttle = rt->raw_throttle;
+			logged_faults = fault_bits;
+			fault_log_ready = 1;
+		}
 	}
 }
 
@@ -500,6 +675,7 @@ void pi_loop(void)
 ISR(TIMER1_OVF_vect)
 {
 	unsigned ui;
+	LOAD_BEGIN();
 	
 	counter_16k++;
 	#ifdef PWM8K
@@ -546,6 +722,7 @@ ISR(TIMER1_OVF_vect)
 	#ifndef PWM8K
 	}
 	#endif
+	LOAD_END(LOAD_PWM);
 }
 
 // timer 1 input capture ISR (1000 hertz)
@@ -572,6 +749,22 @@ unsigned char measure_vref(void)
 	return(1);
 }
 
+// calculate gain sets for pi_loop() from cf
+void calc_gain_sets(config_type *cf, gain_set_type *gs)
+{
+	gs[0].K1 = (long)cf->Kp << 10;
+	gs[0].K2 = (long)cf->Ki - gs[0].K1;
+	gs[0].throttle_pos_gain = cf->throttle_pos_gain;
+	gs[0].throttle_pwm_gain = cf->throttle_pwm_gain;
+	gs[0].current_ramp_rate = cf->current_ramp_rate;
+	gs[1].K1 = (long)cf->Kp2 << 10;
+	gs[1].K2 = (long)cf->Ki2 - gs[1].K1;
+	gs[1].throttle_pos_gain = cf->throttle_pos_gain2;
+	gs[1].throttle_pwm_gain = cf->throttle_pwm_gain2;
+	gs[1].current_ramp_rate = cf->current_ramp_rate2;
+}
+
+// all gain sets are swapped in with one interrupt off window, so pi_loop() never mixes them
 void config_pi(void)
 {
 /* A couple of points:
@@ -580,44 +773,29 @@ void config_pi(void)
 	Also, the PI loop is run at 4KHz instead of 16, so Ki must quadruple for same loop response
 	So for same loop response, Kp is 2X and Ki is 8X */
 	
-	volatile long v1, v2;
-	
-	v1 = (long)config.Kp << 10;
-	v2 = (long)config.Ki - v1;
-	cli(); pi.K1 = v1; pi.K2 = v2; sei();
+	gain_set_type gs[GAIN_SETS];
+
+	calc_gain_sets(&config, gs);
+	cli(); memcpy(gain_set, gs, sizeof(gain_set)); sei();
 }
 
+// copy newest real time data published by pi_loop() - interrupts stay enabled
+// pi_loop() writes the other buffer, so the copy is only bad if pi_loop() published
+// twice while copying - then rt_seq changed and we copy again
 void fetch_rt_data(void)
 {
-	// fetch variable with interrupts off, then re-enable interrupts (interrupts can happen during NOPs)
-	cli(); rt_data.throttle_ref = (volatile int)throttle_ref; sei();
-	asm("nop"); asm("nop"); asm("nop"); asm("nop");
-
-	// fetch variable with interrupts off, then re-enable interrupts (interrupts can happen during NOPs)
-	cli(); rt_data.current_ref = (volatile int)current_ref; sei();
-	asm("nop"); asm("nop"); asm("nop"); asm("nop");
-
-	// fetch variable with interrupts off, then re-enable interrupts (interrupts can happen during NOPs)
-	cli(); rt_data.current_fb = (volatile int)current_fb; sei();
-	asm("nop"); asm("nop"); asm("nop"); asm("nop");
-
-	// fetch variable with interrupts off, then re-enable interrupts (interrupts can happen during NOPs)
-	cli(); rt_data.raw_hs_temp = (volatile unsigned)raw_hs_temp; sei();
-	asm("nop"); asm("nop"); asm("nop"); asm("nop");
-	
-	// fetch variable with interrupts off, then re-enable interrupts (interrupts can happen during NOPs)
-	cli(); rt_data.raw_throttle = (volatile unsigned)raw_throttle; sei();
-	asm("nop"); asm("nop"); asm("nop"); asm("nop");
-
-	// fetch variable with interrupts off, then re-enable interrupts (interrupts can happen during NOPs)
-	cli(); rt_data.battery_amps = (volatile unsigned)battery_amps; sei();
-	asm("nop"); asm("nop"); asm("nop"); asm("nop");
-
-	// fetch variable with interrupts off, then re-enable interrupts (interrupts can happen during NOPs)
-	cli(); rt_data.battery_ah = (volatile unsigned long)battery_ah; sei();
-	asm("nop"); asm("nop"); asm("nop"); asm("nop");
+	unsigned char seq;
+
+	do {
+		seq = rt_seq;
+		asm volatile ("" ::: "memory");
+		memcpy(&rt_data, &rt_buf[seq & 0x01], sizeof(rt_data));
+		asm volatile ("" ::: "memory");
+	} while (seq != rt_seq);
 }
 
+#define EE_ALL_COPIES ((1 << EE_CONFIG_COPIES) - 1)
+
 #if EE_CONFIG_COPIES == 1
 void read_config(void)
 {
@@ -634,86 +812,265 @@ void read_config(void)
 	}
 	memcpy_P(&config, &default_config, sizeof(config));
 }
-
-void write_config(void)
-{
-	config.crc = calc_block_crc(sizeof(config) - sizeof(unsigned), (unsigned char *)&config);
-	watchdog_disable();
-	eeprom_write_block(&config, (void *)EE_CONFIG_ADDRESS, sizeof(config));
-	watchdog_enable();
-}
 #else
+// address of config copy in EEprom
+#define EE_CONFIG_COPY(n) (EE_CONFIG_ADDRESS + ((n) * sizeof(config_type)))
+
+unsigned char config_copy = 0xff;		// copy config was loaded from (0xff if defaults)
+
+// load the newest good copy of config (only the generation of the other copies is read)
 void read_config(void)
 {
-	unsigned char lp, okmask;
-	unsigned address;
-	config_type cf;
+	unsigned char lp, n, best, tried;
+	unsigned gen[EE_CONFIG_COPIES];
 	
-	okmask = 0;
-	address = EE_CONFIG_ADDRESS;
 	for (lp = 0; lp < EE_CONFIG_COPIES; lp++) {
-		okmask = okmask << 1;
-		eeprom_read_block(&cf, (void *)address, sizeof(cf));
-		address += sizeof(config_type);
-		if (cf.magic == 0x12ab) {
+		gen[lp] = eeprom_read_word((void *)(EE_CONFIG_COPY(lp) + offsetof(config_type, gen)));
+	}
+	tried = 0;
+	for (n = 0; n < EE_CONFIG_COPIES; n++) {
+		// pick newest copy not yet tried (generation may have wrapped around)
+		best = 0xff;
+		for (lp = 0; lp < EE_CONFIG_COPIES; lp++) {
+			if (tried & (1 << lp)) continue;
+			if ((best == 0xff) || ((int)(gen[lp] - gen[best]) > 0)) best = lp;
+		}
+		tried |= (1 << best);
+		eeprom_read_block(&config, (void *)EE_CONFIG_COPY(best), sizeof(config));
+		if (config.magic == 0x12ab) {
 			// magic OK
-			if (calc_block_crc(sizeof(cf) - sizeof(unsigned), (unsigned char *)&cf) ==
-			  cf.crc) {
+			if (calc_block_crc(sizeof(config) - sizeof(unsigned), (unsigned char *)&config) ==
+			  config.crc) {
 			  	// CRC ok
-				okmask = okmask | 0x01;
-				memcpy(&config, &cf, sizeof(config));
+				config_copy = best;
 				motor_overspeed_threshold = (unsigned long)config.motor_os_th << 10;
 				bat_amp_lim_510 = (unsigned long)config.battery_amps_limit * (unsigned long)510;
+				return;
 			}
 		}
 	}
-	if (okmask == 0) {
-		// not even one good copy - copy default values and return
-		memcpy_P(&config, &default_config, sizeof(config));
-		return;
+	// not even one good copy - copy default values
+	memcpy_P(&config, &default_config, sizeof(config));
+}
+#endif
+
+// queue copies of config (bit n of copies for copy n) to be written to EEprom in the background
+// saving all copies starts a new generation, writing some copies (repair) keeps the generation
+// return 1 if busy, else 0 - when all copies are written ee_config_done is set
+unsigned char write_config(unsigned char copies)
+{
+	unsigned char lp, n, last;
+	unsigned address;
+	
+	n = 0; last = 0;
+	for (lp = 0; lp < EE_CONFIG_COPIES; lp++) {
+		if (copies & (1 << lp)) {
+			n++; last = lp;
+		}
 	}
-	// we have at least one good copy - repair any bad copies
+	if (ee_config_busy || (ee_queue_free() < n)) return(1);
+	if (copies == EE_ALL_COPIES) config.gen++;
+	config.crc = calc_block_crc(sizeof(config) - sizeof(unsigned), (unsigned char *)&config);
+	memcpy(&ee_config, &config, sizeof(config));
 	address = EE_CONFIG_ADDRESS;
 	for (lp = 0; lp < EE_CONFIG_COPIES; lp++) {
-		okmask = okmask << 1;
-		if ((okmask & (1 << EE_CONFIG_COPIES)) == 0) {
-			// copy is bad
-			watchdog_disable();
-			eeprom_write_block(&config, (void *)address, sizeof(config));
-			watchdog_enable();
+		if (copies & (1 << lp)) {
+			// only the last copy signals completion
+			ee_queue_write(&ee_config, address, sizeof(config_type),
+				(lp == last) ? &ee_config_done : NULL);
 		}
 		address += sizeof(config_type);
 	}
+	ee_config_busy = copies;
+	return(0);
 }
 
-void write_config(void)
+#if EE_CONFIG_COPIES > 1
+// compare the other copies with the loaded config and rewrite stale or bad copies
+// runs once the controller is running, so it does not delay power up
+void repair_config(void)
 {
-	unsigned char lp;
-	unsigned address;
+	unsigned char lp, copies;
+	unsigned n, address;
 	
-	config.crc = calc_block_crc(sizeof(config) - sizeof(unsigned), (unsigned char *)&config);
+	if (config_copy == 0xff) return;		// no good copy, nothing to repair from
+	copies = 0;
 	address = EE_CONFIG_ADDRESS;
 	for (lp = 0; lp < EE_CONFIG_COPIES; lp++) {
-		watchdog_disable();
-		eeprom_write_block(&config, (void *)address, sizeof(config));
-		watchdog_enable();
+		if (lp != config_copy) {
+			for (n = 0; n < sizeof(config_type); n++) {
+				if (ee_read_byte(address + n) != ((unsigned char *)&config)[n]) {
+					copies |= (1 << lp);
+					break;
+				}
+			}
+		}
 		address += sizeof(config_type);
 	}
+	if (copies) write_config(copies);
 }
 #endif
 
+// find newest good battery_ah slot in EE prom and restore battery_ah from it
+void restore_battery_ah(void)
+{
+	unsigned char lp, found;
+	unsigned address;
+	ah_slot_type slot;
+
+	found = 0;
+	address = EE_AH_ADDRESS;
+	for (lp = 0; lp < EE_AH_SLOTS; lp++) {
+		eeprom_read_block(&slot, (void *)address, sizeof(slot));
+		address += sizeof(ah_slot_type);
+		if (calc_block_crc(sizeof(slot) - sizeof(unsigned), (unsigned char *)&slot) == slot.crc) {
+			// slot OK - keep it if it is the first one or newer (seq may have wrapped around)
+			if (!found || ((int)(slot.seq - ah_slot.seq) > 0)) {
+				memcpy(&ah_slot, &slot, sizeof(slot));
+				ah_slot_index = lp;
+				found = 1;
+			}
+		}
+	}
+	if (found) battery_ah = ah_slot.battery_ah;
+}
+
+// save battery_ah to the next slot in EE prom (in the background)
+void save_battery_ah(void)
+{
+	unsigned long ah;
+
+	// wait if previous save still being written or queue full (try again next time)
+	if (!ah_slot_done || (ee_queue_free() == 0)) return;
+	cli(); ah = battery_ah; sei();
+	ah_slot.seq++;
+	ah_slot.battery_ah = ah;
+	ah_slot.crc = calc_block_crc(sizeof(ah_slot) - sizeof(unsigned), (unsigned char *)&ah_slot);
+	ah_slot_index++;
+	if (ah_slot_index >= EE_AH_SLOTS) ah_slot_index = 0;
+	ee_queue_write(&ah_slot, EE_AH_ADDRESS + (ah_slot_index * sizeof(ah_slot_type)),
+		sizeof(ah_slot), &ah_slot_done);
+	ah_save_timer = 0;
+}
+
+// find newest good fault log entry in EE prom, so new events go after it
+void restore_fault_log(void)
+{
+	unsigned char lp, found;
+	unsigned address;
+	fault_log_type entry;
+
+	found = 0;
+	address = EE_LOG_ADDRESS;
+	for (lp = 0; lp < EE_LOG_ENTRIES; lp++) {
+		eeprom_read_block(&entry, (void *)address, sizeof(entry));
+		address += sizeof(fault_log_type);
+		if (calc_block_crc(sizeof(entry) - sizeof(unsigned), (unsigned char *)&entry) == entry.crc) {
+			// entry OK - keep it if it is the first one or newer (seq may have wrapped around)
+			if (!found || ((int)(entry.seq - fault_log_seq) > 0)) {
+				fault_log_seq = entry.seq;
+				fault_log_index = lp;
+				found = 1;
+			}
+		}
+	}
+}
+
+// write fault event captured by pi_loop() to the next entry in EE prom (in the background)
+void save_fault_log(void)
+{
+	// try again next time if queue full
+	if (ee_queue_free() == 0) return;
+	fault_log.seq = ++fault_log_seq;
+	fault_log.uptime = uptime;
+	fault_log.crc = calc_block_crc(sizeof(fault_log) - sizeof(unsigned), (unsigned char *)&fault_log);
+	fault_log_index++;
+	if (fault_log_index >= EE_LOG_ENTRIES) fault_log_index = 0;
+	// fault_log_done is cleared here, so pi_loop() leaves fault_log alone until it is written
+	ee_queue_write(&fault_log, EE_LOG_ADDRESS + (fault_log_index * sizeof(fault_log_type)),
+		sizeof(fault_log), &fault_log_done);
+	fault_log_ready = 0;
+}
+
+// show fault log, oldest event first
+void show_fault_log(void)
+{
+	unsigned char lp, n, index;
+	unsigned address;
+	unsigned long luv;
+	fault_log_type entry;
+
+	index = fault_log_index;
+	for (lp = 0; lp < EE_LOG_ENTRIES; lp++) {
+		index++;
+		if (index >= EE_LOG_ENTRIES) index = 0;
+		// read with ee_read_byte(), an event may be being written right now
+		address = EE_LOG_ADDRESS + (index * sizeof(fault_log_type));
+		for (n = 0; n < sizeof(entry); n++) ((unsigned char *)&entry)[n] = ee_read_byte(address + n);
+		if (calc_block_crc(sizeof(entry) - sizeof(unsigned), (unsigned char *)&entry) != entry.crc) continue;
+		strcpy_P(uart_str, PSTR("#xxxxx xxxxxx.xs bits=xx chg=xx cref=xxx cfb=xxx pwm=xxx hs=xxxx thr=xxxx\r\n"));
+		u16_to_str(&uart_str[1], entry.seq, 5);
+		luv = entry.uptime / 10;
+		if (luv > 999999) luv = 999999;
+		u16_to_str(&uart_str[7], luv / 1000, 3);
+		u16_to_str(&uart_str[10], luv % 1000, 3);
+		u16_to_str(&uart_str[14], entry.uptime % 10, 1);
+		u16x_to_str(&uart_str[22], entry.fault_bits, 2);
+		u16x_to_str(&uart_str[29], entry.changed, 2);
+		u16_to_str(&uart_str[37], entry.current_ref, 3);
+		u16_to_str(&uart_str[45], entry.current_fb, 3);
+		u16_to_str(&uart_str[53], entry.pwm, 3);
+		u16_to_str(&uart_str[60], entry.raw_hs_temp, 4);
+		u16_to_str(&uart_str[69], entry.raw_throttle, 4);
+		uart_putstr();
+	}
+}
+
+char load_names[LOAD_SOURCES][8] PROGMEM = {"pwm/pi ", "uart-rx", "uart-tx", "ee-wr  "};
+
+// convert ISR busy time in a window (4uS units) to 0.1% units
+// a window is 100 ticks of 1.024mS = 25600 units
+unsigned load_permille(unsigned ticks)
+{
+	unsigned long luv;
+
+	luv = ((unsigned long)ticks * 10) >> 8;
+	if (luv > 1000) luv = 1000;
+	return(luv);
+}
+
+// end of a load monitor window (every 100mS) - copy ISR busy times and main loop passes
+void load_window(void)
+{
+	unsigned char lp;
+
+	cli();
+	for (lp = 0; lp < LOAD_SOURCES; lp++) {
+		load_win[lp] = load_ticks[lp];
+		load_ticks[lp] = 0;
+	}
+	sei();
+	for (lp = 0; lp < LOAD_SOURCES; lp++) {
+		if (load_win[lp] > load_peak[lp]) load_peak[lp] = load_win[lp];
+	}
+	main_loops_win = main_loops;
+	main_loops = 0;
+}
+
 void show_menu(void)
 {
 	#ifdef PWM8K
-	strcpy_P(uart_str, PSTR("Cougar OS controller firmware v1.11b (8KPWM)\r\n"));
+	strcpy_P(uart_str, PSTR("Cougar OS controller firmware v1.12 (8KPWM)\r\n"));
 	#else
-	strcpy_P(uart_str, PSTR("Cougar OS controller firmware v1.11b\r\n"));
+	strcpy_P(uart_str, PSTR("Cougar OS controller firmware v1.12\r\n"));
 	#endif
 	uart_putstr();
 }
 
 void show_config(unsigned mask)
 {
+	unsigned char n;
+
 	if (mask & ((unsigned)1 << 0)) {
 		strcpy_P(uart_str, PSTR("Kp=xxx Ki=xxx\r\n"));
 		u16_to_str(&uart_str[3], config.Kp, 3);
@@ -787,137 +1144,367 @@ void show_config(unsigned mask)
 		u16_to_str(&uart_str[15], config.precharge_time, 3);
 		uart_putstr();
 	}
+	if (mask & ((unsigned)1 << 12)) {
+		strcpy_P(uart_str, PSTR("gain set 2: Kp=xxx Ki=xxx t_pos=xxx t_pwm=xxx c_rr=xxx\r\n"));
+		u16_to_str(&uart_str[15], config.Kp2, 3);
+		u16_to_str(&uart_str[22], config.Ki2, 3);
+		u16_to_str(&uart_str[32], config.throttle_pos_gain2, 3);
+		u16_to_str(&uart_str[42], config.throttle_pwm_gain2, 3);
+		u16_to_str(&uart_str[51], config.current_ramp_rate2, 3);
+		uart_putstr();
+	}
+	if (mask & ((unsigned)1 << 13)) {
+		strcpy_P(uart_str, PSTR("gain_switch_lpf=xxx\r\n"));
+		u16_to_str(&uart_str[16], config.gain_switch_lpf, 3);
+		uart_putstr();
+	}
+	if (mask & ((unsigned)1 << 14)) {
+		strcpy_P(uart_str, PSTR("gain_sched=x\r\n"));
+		u16_to_str(&uart_str[11], config.gain_sched, 1);
+		uart_putstr();
+		for (n = 0; n < GS_POINTS; n++) {
+			strcpy_P(uart_str, PSTR("gs x ocr1a_lpf=xxx Kp=xxx Ki=xxx\r\n"));
+			u16_to_str(&uart_str[3], n, 1);
+			u16_to_str(&uart_str[15], n << GS_SHIFT, 3);
+			u16_to_str(&uart_str[22], config.gs_Kp[n], 3);
+			u16_to_str(&uart_str[29], config.gs_Ki[n], 3);
+			uart_putstr();
+		}
+	}
+}
+
+// a parameter (or group of parameters selected by mask) was changed
+// outside of a transaction the change takes effect now and is echoed back
+// inside of a transaction the change is only remembered until "commit"
+void config_changed(unsigned mask)
+{
+	if (tx.active) {
+		tx.mask |= mask;
+		return;
+	}
+	if (mask & (((unsigned)1 << 0) | ((unsigned)1 << 3) | ((unsigned)1 << 4) | ((unsigned)1 << 12))) config_pi();
+	if (mask & ((unsigned)1 << 5)) tm_show_data = get_time();
+	if (mask & ((unsigned)1 << 7)) {
+		cli(); motor_overspeed_threshold = (unsigned long)config.motor_os_th << 10; sei();
+	}
+	if (mask & ((unsigned)1 << 10)) {
+		cli(); bat_amp_lim_510 = (unsigned long)config.battery_amps_limit * (unsigned long)510; sei();
+	}
+	show_config(mask);
+}
+
+// check staged config, then swap it into the PI loop with one interrupt off window
+// return 1 if OK, 0 if staged config is not valid (transaction stays open)
+unsigned char commit_config(void)
+{
+	gain_set_type gs[GAIN_SETS];
+	unsigned long os_th, bal_510;
+	config_type *cf;
+
+	cf = &tx.config;
+	// throttle counts must be ordered fault < min < max (pi_loop() divides by max - min)
+	if (cf->throttle_max_raw_counts <= cf->throttle_min_raw_counts) return(0);
+	if (cf->throttle_fault_raw_counts >= cf->throttle_min_raw_counts) return(0);
+	// calculate everything derived from config before interrupts are turned off
+	calc_gain_sets(cf, gs);
+	os_th = (unsigned long)cf->motor_os_th << 10;
+	bal_510 = (unsigned long)cf->battery_amps_limit * (unsigned long)510;
+	// gen and crc belong to write_config() - a "save" while the transaction was open bumped gen
+	cf->gen = config.gen;
+	cf->crc = config.crc;
+	cli();
+	memcpy(&config, cf, sizeof(config));
+	memcpy(gain_set, gs, sizeof(gain_set));
+	motor_overspeed_threshold = os_th;
+	bat_amp_lim_510 = bal_510;
+	sei();
+	if (tx.mask & ((unsigned)1 << 5)) tm_show_data = get_time();
+	tx.active = 0;
+	return(1);
 }
 
 void process_command(char *cmd, int x)
 {
+	unsigned char lp;
+	unsigned long luv;
+	config_type *cf;
+
+	// while a transaction is open, parameter commands change the staged copy
+	if (tx.active) cf = &tx.config;
+	else cf = &config;
+
 	if (!strcmp_P(cmd, PSTR("config"))) {
 		show_config(0xffff);
 	}
 	else if (!strcmp_P(cmd, PSTR("save"))) {
-		write_config();
-		strcpy_P(uart_str, PSTR("configuration written to EE\r\n"));
+		if (write_config(EE_ALL_COPIES)) strcpy_P(uart_str, PSTR("EE busy\r\n"));
+		else strcpy_P(uart_str, PSTR("writing configuration to EE\r\n"));
+		uart_putstr();
+	}
+	else if (!strcmp_P(cmd, PSTR("begin"))) {
+		memcpy(&tx.config, &config, sizeof(config));
+		tx.mask = 0;
+		tx.active = 1;
+		strcpy_P(uart_str, PSTR("transaction started\r\n"));
+		uart_putstr();
+	}
+	else if (!strcmp_P(cmd, PSTR("commit"))) {
+		if (!tx.active) {
+			strcpy_P(uart_str, PSTR("no transaction\r\n"));
+		}
+		else if (commit_config()) {
+			strcpy_P(uart_str, PSTR("commit OK mask=xxxx\r\n"));
+			u16x_to_str(&uart_str[15], tx.mask, 4);
+		}
+		else {
+			strcpy_P(uart_str, PSTR("commit failed - check throttle counts\r\n"));
+		}
+		uart_putstr();
+	}
+	else if (!strcmp_P(cmd, PSTR("abort"))) {
+		tx.active = 0;
+		strcpy_P(uart_str, PSTR("transaction aborted\r\n"));
 		uart_putstr();
 	}
 	else if (!strcmp_P(cmd, PSTR("idle"))) {
+		// time not spent in ISRs during the last window
+		for (x = lp = 0; lp < LOAD_SOURCES; lp++) x += load_permille(load_win[lp]);
+		if (x > 1000) x = 1000;
 		strcpy_P(uart_str, PSTR("AVR xxx% idle\r\n"));
-		u16_to_str(&uart_str[4],
-			(unsigned)(wait_time(100) * (unsigned long)100 / idle_loopcount),
-			3);		
+		u16_to_str(&uart_str[4], (1000 - x) / 10, 3);
+		uart_putstr();
+	}
+	else if (!strcmp_P(cmd, PSTR("load"))) {
+		for (lp = 0; lp < LOAD_SOURCES; lp++) {
+			strcpy_P(uart_str, PSTR("xxxxxxx xxx.x% peak xxx.x%\r\n"));
+			memcpy_P(uart_str, load_names[lp], 7);
+			x = load_permille(load_win[lp]);
+			u16_to_str(&uart_str[8], x / 10, 3);
+			u16_to_str(&uart_str[12], x % 10, 1);
+			x = load_permille(load_peak[lp]);
+			u16_to_str(&uart_str[20], x / 10, 3);
+			u16_to_str(&uart_str[24], x % 10, 1);
+			uart_putstr();
+			load_peak[lp] = 0;
+		}
+		strcpy_P(uart_str, PSTR("main loop xxxxxx per second\r\n"));
+		// a window is 100 ticks of 1.024mS, so per second is * 1000 / 102.4
+		luv = ((unsigned long)main_loops_win * 625) / 64;
+		if (luv > 999999) luv = 999999;
+		u16_to_str(&uart_str[10], luv / 1000, 3);
+		u16_to_str(&uart_str[13], luv % 1000, 3);
 		uart_putstr();
 	}
+	else if (!strcmp_P(cmd, PSTR("boot-timeline"))) {
+		strcpy_P(uart_str, PSTR("crc-check took xxxx.x mS\r\n"));
+		x = ((unsigned long)tm_crc * 64) / 100;		// 64uS units to 0.1mS units
+		u16_to_str(&uart_str[15], x / 10, 4);
+		u16_to_str(&uart_str[20], x % 10, 1);
+		uart_putstr();
+		for (x = 0; x < BT_PHASES; x++) {
+			strcpy_P(uart_str, boot_phase_names[x]);
+			if (boot_time[x] == 0xffff) strcat_P(uart_str, PSTR(" not yet\r\n"));
+			else {
+				strcat_P(uart_str, PSTR(" at xxxxx mS\r\n"));
+				u16_to_str(&uart_str[strlen(uart_str) - 10], boot_time[x], 5);
+			}
+			uart_putstr();
+		}
+	}
+	else if (!strcmp_P(cmd, PSTR("gain-set"))) {
+		// 1 or 2 to use that gain set, 0 to switch on ocr1a_lpf ("gain-sw-lpf")
+		if ((unsigned)x <= GAIN_SETS) {
+			if (x == 0) {
+				// pick the set for ocr1a_lpf now, so the set shown below is the one auto uses
+				cli();
+				gain_mode = GAIN_AUTO;
+				if (config.gain_switch_lpf && (ocr1a_lpf > config.gain_switch_lpf)) gains = &gain_set[1];
+				else gains = &gain_set[0];
+				sei();
+			}
+			else {
+				gain_mode = x - 1;
+				cli(); gains = &gain_set[gain_mode]; sei();
+			}
+		}
+		if (gain_mode == GAIN_AUTO) strcpy_P(uart_str, PSTR("gain set x (auto)\r\n"));
+		else strcpy_P(uart_str, PSTR("gain set x\r\n"));
+		cli(); x = gains - gain_set; sei();
+		u16_to_str(&uart_str[9], x + 1, 1);
+		uart_putstr();
+	}
+	else if (!strcmp_P(cmd, PSTR("faults"))) {
+		show_fault_log();
+	}
 	else if (!strcmp_P(cmd, PSTR("restart"))) {
+		// without the marker the bootloader takes a watchdog reset as a crash and starts us again
+		// (top of SRAM is only main()'s return address, main() never returns)
+		cli();
+		*(volatile unsigned *)(RAMEND - 1) = BOOT_MAGIC;
+		sei();
 		watchdog_enable();
 		while(1);
 	}
 	else if (!strcmp_P(cmd, PSTR("reset-ah"))) {
 		cli(); battery_ah = 0; sei();
+		ah_save_timer = AH_SAVE_TIME;		// save the reset right away
 		strcpy_P(uart_str, PSTR("battery amp hours reset\r\n"));
 		uart_putstr();
 	}
 	else if (!strcmp_P(cmd, PSTR("kp"))) {
 		if ((unsigned)x <= 500) {
-			config.Kp = x; config_pi();
-			show_config((unsigned)1 << 0);
+			cf->Kp = x;
+			config_changed((unsigned)1 << 0);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("ki"))) {
 		if ((unsigned)x <= 500) {
-			config.Ki = x; config_pi();
-			show_config((unsigned)1 << 0);
+			cf->Ki = x;
+			config_changed((unsigned)1 << 0);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("t-min-rc"))) {
 		if ((unsigned)x <= 1023) {
-			cli(); config.throttle_min_raw_counts = x; sei();
-			show_config((unsigned)1 << 1);
+			cli(); cf->throttle_min_raw_counts = x; sei();
+			config_changed((unsigned)1 << 1);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("t-max-rc"))) {
 		if ((unsigned)x <= 1023) {
-			cli(); config.throttle_max_raw_counts = x; sei();
-			show_config((unsigned)1 << 1);
+			cli(); cf->throttle_max_raw_counts = x; sei();
+			config_changed((unsigned)1 << 1);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("t-fault-rc"))) {
 		if ((unsigned)x <= 1023) {
-			cli(); config.throttle_fault_raw_counts = x; sei();
-			show_config((unsigned)1 << 2);
+			cli(); cf->throttle_fault_raw_counts = x; sei();
+			config_changed((unsigned)1 << 2);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("t-pos-gain"))) {
 		if ((unsigned)x <= 128) {
-			cli(); config.throttle_pos_gain = x; sei();
-			show_config((unsigned)1 << 3);
+			cli(); cf->throttle_pos_gain = x; sei();
+			config_changed((unsigned)1 << 3);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("t-pwm-gain"))) {
 		if ((unsigned)x <= 128) {
-			cli(); config.throttle_pwm_gain = x; sei();
-			show_config((unsigned)1 << 3);
+			cli(); cf->throttle_pwm_gain = x; sei();
+			config_changed((unsigned)1 << 3);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("c-rr"))) {
 		if ((unsigned)x <= 100) {
-			cli(); config.current_ramp_rate = x; sei();
-			show_config((unsigned)1 << 4);
+			cli(); cf->current_ramp_rate = x; sei();
+			config_changed((unsigned)1 << 4);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("rtd-period"))) {
 		if ((unsigned)x <= 32000) {
-			config.rtd_period = x;
-			tm_show_data = get_time();
-			show_config((unsigned)1 << 5);
+			cf->rtd_period = x;
+			config_changed((unsigned)1 << 5);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("pwm-filter"))) {
 		if ((unsigned)x <= 3) {
-			cli(); config.pwm_filter = x; sei();
-			show_config((unsigned)1 << 6);
+			cli(); cf->pwm_filter = x; sei();
+			config_changed((unsigned)1 << 6);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("motor-os-th"))) {
 		if ((unsigned)x <= 9999) {
-			config.motor_os_th = x;
-			motor_overspeed_threshold = (unsigned long)config.motor_os_th << 10;
-			show_config((unsigned)1 << 7);
+			cf->motor_os_th = x;
+			config_changed((unsigned)1 << 7);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("motor-os-ft"))) {
 		if ((unsigned)x <= 9999) {
-			config.motor_os_ft = x;
-			show_config((unsigned)1 << 7);
+			cf->motor_os_ft = x;
+			config_changed((unsigned)1 << 7);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("motor-os-dt"))) {
 		if ((unsigned)x <= 99) {
-			config.motor_os_dt = x;
-			show_config((unsigned)1 << 8);
+			cf->motor_os_dt = x;
+			config_changed((unsigned)1 << 8);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("pwm-deadzone"))) {
 		if ((unsigned)x <= 99) {
-			config.pwm_deadzone = x;
-			show_config((unsigned)1 << 8);
+			cf->pwm_deadzone = x;
+			config_changed((unsigned)1 << 8);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("motor-sc-amps"))) {
 		if ((unsigned)x <= MAX_CURRENT_REF) {
-			config.motor_sc_amps = x;
-			show_config((unsigned)1 << 9);
+			cf->motor_sc_amps = x;
+			config_changed((unsigned)1 << 9);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("bat-amps-lim"))) {
 		if ((unsigned)x <= MAX_CURRENT_REF) {
-			config.battery_amps_limit = x;
-			bat_amp_lim_510 = (unsigned long)config.battery_amps_limit * (unsigned long)510;
-			show_config((unsigned)1 << 10);
+			cf->battery_amps_limit = x;
+			config_changed((unsigned)1 << 10);
 		}
 	}
 	else if (!strcmp_P(cmd, PSTR("pc-time"))) {
 		if ((unsigned)x <= 999) {
-			config.precharge_time = x;
-			show_config((unsigned)1 << 11);
+			cf->precharge_time = x;
+			config_changed((unsigned)1 << 11);
+		}
+	}
+	else if (!strcmp_P(cmd, PSTR("kp2"))) {
+		if ((unsigned)x <= 500) {
+			cf->Kp2 = x;
+			config_changed((unsigned)1 << 12);
+		}
+	}
+	else if (!strcmp_P(cmd, PSTR("ki2"))) {
+		if ((unsigned)x <= 500) {
+			cf->Ki2 = x;
+			config_changed((unsigned)1 << 12);
+		}
+	}
+	else if (!strcmp_P(cmd, PSTR("t-pos-gain2"))) {
+		if ((unsigned)x <= 128) {
+			cf->throttle_pos_gain2 = x;
+			config_changed((unsigned)1 << 12);
+		}
+	}
+	else if (!strcmp_P(cmd, PSTR("t-pwm-gain2"))) {
+		if ((unsigned)x <= 128) {
+			cf->throttle_pwm_gain2 = x;
+			config_changed((unsigned)1 << 12);
+		}
+	}
+	else if (!strcmp_P(cmd, PSTR("c-rr2"))) {
+		if ((unsigned)x <= 100) {
+			cf->current_ramp_rate2 = x;
+			config_changed((unsigned)1 << 12);
+		}
+	}
+	else if (!strcmp_P(cmd, PSTR("gain-sched"))) {
+		if ((unsigned)x <= 1) {
+			cli(); cf->gain_sched = x; sei();
+			config_changed((unsigned)1 << 14);
+		}
+	}
+	else if (!strncmp_P(cmd, PSTR("gs-k"), 4) && ((cmd[4] == 'p') || (cmd[4] == 'i')) &&
+	  (cmd[5] >= '0') && (cmd[5] < '0' + GS_POINTS) && !cmd[6]) {
+		// gs-kpN or gs-kiN, N is the gain schedule point
+		if ((unsigned)x <= 500) {
+			lp = cmd[5] - '0';
+			cli();
+			if (cmd[4] == 'p') cf->gs_Kp[lp] = x;
+			else cf->gs_Ki[lp] = x;
+			sei();
+			config_changed((unsigned)1 << 14);
+		}
+	}
+	else if (!strcmp_P(cmd, PSTR("gain-sw-lpf"))) {
+		if ((unsigned)x <= 510) {
+			cli(); cf->gain_switch_lpf = x; sei();
+			config_changed((unsigned)1 << 13);
 		}
 	}
 }
@@ -950,14 +1537,20 @@ int main(void)
 {
 	int x;
 	unsigned tm_100;
+	unsigned long luv;
 	unsigned char cmdpos, cmdok;
 	char cmd[32];
 	
 #ifdef crc_address
 	unsigned crc1, crc2;
 	
+	// time the CRC check with timer 1 (16MHz / 1024, so 64uS per count)
+	TCNT1 = 0;
+	TCCR1B = (1 << CS12) | (1 << CS10);
 	crc1 = pgm_read_word(crc_address);		// read program CRC
 	crc2 = calc_prog_crc(crc_address);		// read program CRC
+	tm_crc = TCNT1;
+	TCCR1B = 0;
 	if (crc1 != crc2) {
 		// program CRC error
 		while(1);							// do nothing for ever
@@ -970,10 +1563,22 @@ int main(void)
 	PORTB = 0xff & ~PB_PWM;					// PWM output low, other outputs high, weak pullups on
 	DDRB = PB_PWM | PB_OC_CLEAR;			// two pins outputs
 	
-	// for ATMEGA168 disable digital input buffers on pins used for ADC - page 258 of Mega168 PDF
-	#ifdef MEGA168
+	// set up input capture 1 interrupt at 976Hz
+	// this is only for temporary timing until timer 1 is used for PWM
+	// the reason for 976Hz instead of 1000Hz is explained below
+	TCNT1 = 0;								// load 16 bit counter 1
+	ICR1 = (long)F_OSC / 976;				// timer at 976 Hz
+	TCCR1A = 0;								// no output action on match
+	// let counter 1 run at fosc, reset to 0 at ICR1
+	TCCR1B = (1 << WGM13) | (1 << WGM12) | (1 << CS10);
+	TIMSK = (1 << TICIE1);					// enable input capture 1 interrupt
+	// timer 0 free running at 16MHz / 64 (4uS per count) for the CPU load monitor
+	TCCR0 = (1 << CS01) | (1 << CS00);
+	// start time base now - start up phases and the precharge wait are timed from here
+	sei();
+	
+	// disable digital input buffers on pins used for ADC - page 258 of Mega168 PDF
 	DIDR0 = (1 << ADC2D) | (1 << ADC1D) | (1 << ADC0D);
-	#endif
 	
 	// External Vcc (5v) for analog reference
 	ADMUX = (1 << REFS0);
@@ -988,27 +1593,29 @@ int main(void)
 	ADCSRA = (1 << ADEN) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0) | (1 << ADSC);
 	while (ADCSRA & (1 << ADSC));
 	
-	// set up input capture 1 interrupt at 976Hz
-	// this is only for temporary timing until timer 1 is used for PWM
-	// the reason for 976Hz instead of 1000Hz is explained below
-	TCNT1 = 0;								// load 16 bit counter 1
-	ICR1 = (long)F_OSC / 976;				// timer at 976 Hz
-	TCCR1A = 0;								// no output action on match
-	// let counter 1 run at fosc, reset to 0 at ICR1
-	TCCR1B = (1 << WGM13) | (1 << WGM12) | (1 << CS10);
-	TIMSK = (1 << TICIE1);					// enable input capture 1 interrupt
-	
 	read_config();												// read config from EEprom
+	restore_battery_ah();					// read battery amp hours from EEprom
+	restore_fault_log();					// find where the next fault event goes
+	boot_time[BT_CONFIG] = get_time();
 
 	if (config.precharge_time > 0) {
 		// if precharge timer enabled
 		fault_bits |= PRECHARGE_WAIT;
 		precharge_timer = config.precharge_time + 5;
 	}
+	else boot_time[BT_PRECHARGE] = get_time();
 	config_pi();							// configure PI loop from config structure
-	// interrups are now enabled by config_pi() - sei() instruction in config_pi()
 
-	idle_loopcount = wait_time(100);		// wait 100mS and remember how many loops we did
+	// the serial port doesn't need settled voltages, so it and the menu go in the settle wait
+	setup_uart();									// uart 19200,n,8,1
+	show_menu();									// might as well
+	boot_time[BT_UART] = get_time();
+
+	// voltages settle from key on, so wait until the time base has run 100mS
+	// this is part of the precharge wait
+	x = get_time();
+	if (x < 100) wait_time(100 - x);
+	boot_time[BT_SETTLE] = get_time();
 
 	watchdog_enable();						// enable watchdog now
 
@@ -1017,6 +1624,7 @@ int main(void)
 		// vref out of range
 		fault_bits |= VREF_FAULT;
 	}
+	boot_time[BT_VREF] = get_time();
 	// clear overcurrent fault (powerup in unknown state)
 	clear_oc();
 
@@ -1033,19 +1641,32 @@ int main(void)
 	TCCR1B = (1 << CS10);					// Pre-scaler = 1
     OCR1A = 0;								// again, just to be safe
 	TIMSK = (1 << TOIE1);					// enable overflow 1 interrupt
+	boot_time[BT_PWM] = get_time();
 	// now the PWM frequency = 16000000 / (1 << 9) / 2
 	// so PWM frequency = 16000000 / 1024 = 15625Hz
 	// now, counter_1k is incremented every 16 interrupt, so 15625 / 16 = 976.5625Hz
 	// this is why we run SIG_INPUT_CAPTURE1 at 976Hz
 	
-	setup_uart();									// uart 19200,n,8,1
-	show_menu();									// might as well
+	#if EE_CONFIG_COPIES > 1
+	repair_config();						// now fix any stale or bad config copies
+	#endif
 	// init some time variables
-	tm_show_data = tm_100 = get_time();
+	tm_show_data = get_time();
+	// uptime and the precharge wait count from when the time base started - start the 100mS
+	// timer now and take the start up time off them, instead of a burst of 100mS ticks
+	tm_100 = get_time();
+	x = tm_100 / 100;
+	uptime = x;
+	if (fault_bits & PRECHARGE_WAIT) {
+		// the contactor still gets its half second before the precharge wait is over
+		if (precharge_timer > x + 5) precharge_timer -= x;
+		else if (precharge_timer > 5) precharge_timer = 5;
+	}
 	// now listen on serial port for commands
 	memset(cmd, 0, sizeof(cmd)); cmdpos = 0;
 	while (1) {
 		wdt_reset();
+		main_loops++;
 		x = uart_getch();
 		if (x >= 0) {
 			if (x != 0x0d) {
@@ -1084,6 +1705,18 @@ int main(void)
 			}
 		}
 		/* add non time-critical code below */
+		// remember when we were first ready to drive
+		if ((boot_time[BT_READY] == 0xffff) && (fault_bits == 0)) boot_time[BT_READY] = get_time();
+		// write fault event captured by pi_loop() to EE prom
+		if (fault_log_ready) save_fault_log();
+		// report when background write of configuration is done (saves only, repair is silent)
+		if (ee_config_busy && ee_config_done) {
+			if (ee_config_busy == EE_ALL_COPIES) {
+				strcpy_P(uart_str, PSTR("configuration written to EE\r\n"));
+				uart_putstr();
+			}
+			ee_config_busy = 0;
+		}
 		// fetch real time data
 		fetch_rt_data();
 		// do thermal cutback (based on real time data)
@@ -1097,11 +1730,10 @@ int main(void)
 				u16_to_str(&uart_str[3], rt_data.throttle_ref, 3);
 				u16_to_str(&uart_str[10], rt_data.current_ref, 3);
 				u16_to_str(&uart_str[17], rt_data.current_fb, 3);
-				cli(); x = ocr1a_ghost; sei();
-				u16_to_str(&uart_str[24], (unsigned)x, 3);
+				u16_to_str(&uart_str[24], rt_data.pwm, 3);
 				u16_to_str(&uart_str[31], rt_data.raw_hs_temp, 4);
 				u16_to_str(&uart_str[39], rt_data.raw_throttle, 4);
-				u16x_to_str(&uart_str[47], fault_bits, 2);
+				u16x_to_str(&uart_str[47], rt_data.fault_bits, 2);
 				u16_to_str(&uart_str[53], rt_data.battery_amps, 3);
 				// battery_ah is in amp milliseconds, to convert to Ah divide by 3600000
 				// well almost, summation is at 976.56 hertz, so divide by 3515625
@@ -1116,6 +1748,14 @@ int main(void)
 		if (diff_time(tm_100) >= 100) {
 			// 100 mS passed since last time, adjust tm_100 to trigger again
 			tm_100 += 100;
+			uptime++;
+			load_window();
+			// save battery_ah every AH_SAVE_TIME if it changed
+			if (ah_save_timer < AH_SAVE_TIME) ah_save_timer++;
+			else {
+				cli(); luv = battery_ah; sei();
+				if (luv != ah_slot.battery_ah) save_battery_ah();
+			}
 			// if fault, toggle LED, else light LED
 			if (fault_bits) {
 				PORTD ^= PD_LED;
@@ -1129,6 +1769,7 @@ int main(void)
 					if (precharge_timer == 0) {
 						// remove precharge wait condition to enable power to motor
 						cli(); fault_bits &= ~PRECHARGE_WAIT; sei();
+						boot_time[BT_PRECHARGE] = get_time();
 					}
 					else {
 						// with half a second left in precharge, close contactor
@@ -2,14 +2,35 @@
 
 #define PROGSTART 0x0000				// program start address
 
+#define BOOT_MAGIC 0xb007				// left at the top of SRAM by "restart" so the bootloader waits for avrboot
+
 #define EE_CONFIG_ADDRESS 0				// address of config in EEprom
 
-#define EE_CONFIG_COPIES 4				// store multiple copies of config in EE prom
+#define EE_CONFIG_COPIES 3				// store multiple copies of config in EE prom
+
+#define EE_QUEUE_SIZE 8					// EEprom write queue entries (one is always unused)
+
+// battery_ah is saved in a ring of slots after the config copies in EE prom
+// each save goes to the next slot, so each slot is written once every EE_AH_SLOTS saves
+// one save per minute of driving -> 12 * 100000 minutes (20000 hours) before wear out
+#define EE_AH_SLOTS 12					// number of battery_ah slots in EE prom
+#define AH_SAVE_TIME 600				// 0.1 second units between saves (if battery_ah changed)
+
+// fault events (THROTTLE_FAULT, VREF_FAULT, MOTOR_OS_FAULT set or cleared) are logged in a ring
+// after the battery_ah slots, 3 config copies (74 bytes each) + 12 battery_ah slots (8 bytes each)
+// + 8 log entries (20 bytes each) = 478 of the 512 bytes of EE prom (checked in cougar.c)
+#define EE_LOG_ENTRIES 8				// number of fault log entries in EE prom
 
 #define OC_CLEAR_ENABLED				// defin to enable AVR to clear OC fault
 
 #define NUM_OC_CYCLES_OFF 4				// number of overcurrent cycles off (at 4KHz)
 
+#define GAIN_SWITCH_HYST 8				// ocr1a_lpf hysteresis for automatic gain set switching
+
+// gain schedule - Kp and Ki at ocr1a_lpf 0, 128, 256, 384 and 512, interpolated in between
+#define GS_POINTS 5
+#define GS_SHIFT 7						// ocr1a_lpf >> GS_SHIFT is the table index
+
 #define THROTTLE_FAULT_COUNTS 200		// number of milliseconds throttle must be bad to raise fault
 
 #define HPL_THROTTLE_THRESHOLD 2		// high pedal lockout threshold (compared to throttle_ref [0 to 511])
@@ -33,6 +54,9 @@
 #define MOTOR_OS_FAULT (1 << 6)
 #define HPL_FAULT (1 << 7)
 
+// fault bits that are logged to EE prom when they are set or cleared
+#define LOG_FAULTS (THROTTLE_FAULT | VREF_FAULT | MOTOR_OS_FAULT)
+
 #define PINB_OC_STATE (1 << PINB0)		// OC state (high means fault)
 #define PB_PWM (1 << PB1)				// PWM output pin (high to turn FETs on)
 #define PB_OC_CLEAR (1 << PB2)			// OC clear (low to clear, high for normal operation)
@@ -43,6 +67,25 @@
 // three analog inputs used, these pins must be inputs and weak pullups off
 #define PC_ANALOGS_USED ((1 << PC0) | (1 << PC1) | (1 << PC2))
 
+// CPU load monitor - every ISR adds its busy time (timer 0 counts, 4uS each) to load_ticks[]
+// the main loop takes a window of these every 100mS ("load" command)
+#define LOAD_PWM 0						// timer 1 overflow ISR (ADC, overcurrent, PI loop)
+#define LOAD_UART_RX 1					// uart receive ISR
+#define LOAD_UART_TX 2					// uart UDR empty ISR
+#define LOAD_EE 3						// EEprom ready ISR (eewrite.c)
+#define LOAD_SOURCES 4
+
+extern volatile unsigned load_ticks[LOAD_SOURCES];
+extern volatile unsigned load_all;
+
+// put LOAD_BEGIN() after the local variables of an ISR, and LOAD_END(source) at the end
+// timer 0 counts are 8 bit, so an ISR must take less than 1mS
+// the time of ISRs nested inside (PI loop enables interrupts) is subtracted using load_all
+#define LOAD_BEGIN() unsigned char load_t0 = TCNT0; unsigned load_a0 = load_all
+#define LOAD_END(source) { \
+	unsigned load_d = (unsigned char)(TCNT0 - load_t0) - (load_all - load_a0); \
+	load_all += load_d; load_ticks[source] += load_d; }
+
 #define PARITY_NONE	0x00
 #define PARITY_EVEN	0x02
 #define PARITY_ODD	0x03
@@ -68,3 +111,13 @@ void uart_putstr(void);
 
 // set up UART to 19200,n,8,1
 void setup_uart(void);
+
+// queue nbytes at buf to be written to EEprom address (return 1 if queue full, else 0)
+// buf must not change until *done is set to 1 (done can be NULL)
+unsigned char ee_queue_write(void *buf, unsigned address, unsigned nbytes, volatile unsigned char *done);
+
+// return number of free entries in EEprom write queue
+unsigned char ee_queue_free(void);
+
+// read byte from EEprom (safe while EEprom write queue is busy)
+unsigned char ee_read_byte(unsigned address);
@@ -0,0 +1,129 @@
+/*
+interrupt driven EEprom writer for cougar.c
+bytes are written from the EE ready interrupt, so the main loop never waits for the EEprom
+only bytes that differ from what is already in the EEprom are written
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/iom168.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cougar.h"
+
+#define EEMWE EEMPE
+#define EEWE EEPE
+
+// one queued write
+typedef struct {
+	unsigned char *buf;					// source in SRAM (must not change until written)
+	unsigned address;					// destination in EEprom
+	unsigned nbytes;					// bytes left to write
+	volatile unsigned char *done;		// set to 1 when written (can be NULL)
+} ee_request_type;
+
+typedef struct {
+	ee_request_type rq[EE_QUEUE_SIZE];
+	volatile unsigned char head;
+	volatile unsigned char tail;
+} ee_queue_type;
+
+ee_queue_type ee_queue;
+
+/* EEprom ready interrupt - handles one byte of the request at the queue tail */
+ISR(EE_READY_vect)
+{
+	unsigned char c, i;
+	ee_request_type *rq;
+	LOAD_BEGIN();
+
+	i = ee_queue.tail;
+	if (i == ee_queue.head) {
+		// queue empty - disable EE ready interrupt
+		EECR &= ~(1 << EERIE);
+		LOAD_END(LOAD_EE);
+		return;
+	}
+	rq = &ee_queue.rq[i];
+	c = *rq->buf;
+	EEAR = rq->address;
+	EECR |= (1 << EERE);
+	if (EEDR != c) {
+		// byte changed - start write, this interrupt fires again when the write is done
+		EEDR = c;
+		EECR |= (1 << EEMWE);
+		EECR |= (1 << EEWE);
+	}
+	// if byte was unchanged this interrupt fires again right away for the next byte
+	rq->buf++;
+	rq->address++;
+	if (--rq->nbytes == 0) {
+		// request done
+		if (rq->done) *rq->done = 1;
+		i++;
+		if (i >= EE_QUEUE_SIZE) i = 0;
+		ee_queue.tail = i;
+	}
+	LOAD_END(LOAD_EE);
+}
+
+// queue nbytes at buf to be written to EEprom address (return 1 if queue full, else 0)
+unsigned char ee_queue_write(void *buf, unsigned address, unsigned nbytes, volatile unsigned char *done)
+{
+	unsigned char i;
+	ee_request_type *rq;
+
+	if (nbytes == 0) {
+		if (done) *done = 1;
+		return(0);
+	}
+	i = ee_queue.head + 1;
+	if (i >= EE_QUEUE_SIZE) i = 0;
+	if (i == ee_queue.tail) {
+		// queue full
+		return(1);
+	}
+	rq = &ee_queue.rq[ee_queue.head];
+	rq->buf = buf;
+	rq->address = address;
+	rq->nbytes = nbytes;
+	rq->done = done;
+	// only cleared once queued - a full queue leaves the caller's flag as it was
+	if (done) *done = 0;
+	ee_queue.head = i;
+	// enable EE ready interrupt
+	EECR |= (1 << EERIE);
+	return(0);
+}
+
+// return number of free entries in queue
+unsigned char ee_queue_free(void)
+{
+	unsigned char i, j;
+
+	i = ee_queue.head;
+	j = ee_queue.tail;
+	if (i < j) i += EE_QUEUE_SIZE;
+	return(EE_QUEUE_SIZE - 1 - (i - j));
+}
+
+// read byte from EEprom (safe while the EE ready interrupt is writing)
+unsigned char ee_read_byte(unsigned address)
+{
+	unsigned char c;
+
+	while (1) {
+		cli();
+		if (!(EECR & (1 << EEWE))) {
+			// no write in progress - read with interrupts off so EEAR can't change
+			EEAR = address;
+			EECR |= (1 << EERE);
+			c = EEDR;
+			sei();
+			return(c);
+		}
+		sei();
+	}
+}
@@ -0,0 +1,180 @@
+/*
+  Intel HEX reader and writer (used by hexmerge and avrboot)
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ihex.h"
+
+#define BAD 0xff
+
+static const char hex_digit[16] = "0123456789ABCDEF";
+
+// value of each character as a hex digit, BAD if it isn't one
+static const unsigned char hex_value[256] = {
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, 10, 11, 12, 13, 14, 15, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, 10, 11, 12, 13, 14, 15, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD
+};
+
+static int rd_error(ihex_reader *rd, const char *fmt, ...)
+{
+	int n;
+	va_list ap;
+
+	n = snprintf(rd->err, sizeof(rd->err), "%s:%d: ", rd->fname, rd->line);
+	va_start(ap, fmt);
+	vsnprintf(rd->err + n, sizeof(rd->err) - n, fmt, ap);
+	va_end(ap);
+	return(-1);
+}
+
+int ihex_open(ihex_reader *rd, const char *fname)
+{
+	memset(rd, 0, sizeof(ihex_reader));
+	rd->fname = fname;
+	rd->fh = fopen(fname, "r");
+	if (!rd->fh) {
+		snprintf(rd->err, sizeof(rd->err), "%s: %s", fname, strerror(errno));
+		return(-1);
+	}
+	return(0);
+}
+
+void ihex_close(ihex_reader *rd)
+{
+	if (rd->fh) fclose(rd->fh);
+	rd->fh = NULL;
+}
+
+// next data record into rec
+// returns 1 for data, 0 at the end of file record (or end of file), -1 with rd->err set
+int ihex_read(ihex_reader *rd, ihex_record *rec)
+{
+	int x, n, len, type, sum;
+	unsigned char hi, lo;
+	unsigned char *s;
+	unsigned char b[IHEX_MAXDATA + 5];
+
+	while (fgets(rd->buf, sizeof(rd->buf), rd->fh)) {
+		rd->line++;
+		s = (unsigned char *)rd->buf;
+		n = strlen(rd->buf);
+		if ((n == (sizeof(rd->buf) - 1)) && (s[n - 1] != '\n')) return(rd_error(rd, "line too long"));
+		// strip line end (CR LF or LF) and trailing blanks
+		while ((n > 0) && ((s[n - 1] == '\n') || (s[n - 1] == '\r') || (s[n - 1] == ' ') || (s[n - 1] == '\t'))) n--;
+		if (n == 0) continue;
+		if (s[0] != ':') return(rd_error(rd, "record doesn't start with ':'"));
+		if ((n < 11) || !(n & 1)) return(rd_error(rd, "bad record length (%d characters)", n));
+		// decode all bytes (count, address, type, data, checksum) and sum them
+		n = (n - 1) / 2; sum = 0;
+		for (x = 0; x < n; x++) {
+			hi = hex_value[s[(2 * x) + 1]];
+			lo = hex_value[s[(2 * x) + 2]];
+			if ((hi | lo) == BAD) return(rd_error(rd, "bad hex digit in column %d", (2 * x) + ((hi == BAD) ? 2 : 3)));
+			b[x] = (hi << 4) | lo;
+			sum += b[x];
+		}
+		len = b[0];
+		if (n != (len + 5)) return(rd_error(rd, "byte count %d doesn't match record", len));
+		if (sum & 0xff) return(rd_error(rd, "checksum error (0x%02X)", b[n - 1]));
+		type = b[3];
+		switch (type) {
+			case IHEX_DATA:
+				rec->address = rd->base + ((b[1] << 8) | b[2]);
+				rec->len = len;
+				memcpy(rec->data, &b[4], len);
+				return(1);
+			case IHEX_EOF:
+				return(0);
+			case IHEX_SEGMENT:
+				if (len != 2) return(rd_error(rd, "bad segment record"));
+				rd->base = ((b[4] << 8) | b[5]) << 4;
+				break;
+			case IHEX_LINEAR:
+				if (len != 2) return(rd_error(rd, "bad linear address record"));
+				rd->base = ((b[4] << 8) | b[5]) << 16;
+				break;
+			case IHEX_START_SEGMENT:
+			case IHEX_START_LINEAR:
+				// start address - nothing to do for an AVR
+				break;
+			default:
+				return(rd_error(rd, "unknown record type 0x%02X", type));
+		}
+	}
+	if (ferror(rd->fh)) {
+		snprintf(rd->err, sizeof(rd->err), "%s: %s", rd->fname, strerror(errno));
+		return(-1);
+	}
+	return(0);
+}
+
+// write one record (":" count address type data checksum, DOS line end)
+int ihex_write_record(FILE *fh, int type, unsigned address, const unsigned char *data, int len)
+{
+	int x;
+	unsigned char c, sum;
+	char *s;
+	char str[IHEX_MAXLINE + 4];
+
+	s = str;
+	*s++ = ':';
+	sum = 0;
+	#define PUT_BYTE(v) c = (v); sum += c; *s++ = hex_digit[c >> 4]; *s++ = hex_digit[c & 0x0f]
+	PUT_BYTE(len);
+	PUT_BYTE((address >> 8) & 0xff);
+	PUT_BYTE(address & 0xff);
+	PUT_BYTE(type);
+	for (x = 0; x < len; x++) {
+		PUT_BYTE(data[x]);
+	}
+	PUT_BYTE((0 - sum) & 0xff);
+	#undef PUT_BYTE
+	*s++ = '\r';
+	*s++ = '\n';
+	if (fwrite(str, 1, s - str, fh) != (s - str)) return(-1);
+	return(0);
+}
+
+void ihex_writer_init(ihex_writer *w, FILE *fh)
+{
+	w->fh = fh;
+	w->prev = 0;
+}
+
+// write data record, with a segment record first when the address crosses into the next 64K
+int ihex_write_data(ihex_writer *w, unsigned address, const unsigned char *data, int len)
+{
+	unsigned char seg[2];
+
+	if ((address & 0xffff0000) != (w->prev & 0xffff0000)) {
+		seg[0] = (address >> 12) & 0xff;
+		seg[1] = (address >> 4) & 0xff;
+		if (ihex_write_record(w->fh, IHEX_SEGMENT, 0, seg, 2)) return(-1);
+	}
+	w->prev = address;
+	return(ihex_write_record(w->fh, IHEX_DATA, address & 0xffff, data, len));
+}
+
+int ihex_write_end(ihex_writer *w)
+{
+	return(ihex_write_record(w->fh, IHEX_EOF, 0, NULL, 0));
+}
@@ -0,0 +1,53 @@
+/*
+  Intel HEX reader and writer (used by hexmerge and avrboot)
+
+  reading is one record at a time, so files of any size go through a fixed buffer,
+  hex digits are decoded with a table and each record is checked once
+*/
+
+#ifndef IHEX_H
+#define IHEX_H
+
+#include <stdio.h>
+
+#define IHEX_MAXDATA 255
+#define IHEX_MAXLINE ((2 * IHEX_MAXDATA) + 16)
+
+#define IHEX_DATA 0x00
+#define IHEX_EOF 0x01
+#define IHEX_SEGMENT 0x02								// extended segment address (I16HEX)
+#define IHEX_START_SEGMENT 0x03
+#define IHEX_LINEAR 0x04								// extended linear address (I32HEX)
+#define IHEX_START_LINEAR 0x05
+
+// one data record
+typedef struct {
+	unsigned address;									// with segment/linear base added
+	int len;
+	unsigned char data[IHEX_MAXDATA];
+} ihex_record;
+
+typedef struct {
+	FILE *fh;
+	const char *fname;
+	int line;
+	unsigned base;										// from the last 02 or 04 record
+	char buf[IHEX_MAXLINE + 2];
+	char err[256];										// "file:line: why" after ihex_read() returns -1
+} ihex_reader;
+
+typedef struct {
+	FILE *fh;
+	unsigned prev;										// address of the last data record
+} ihex_writer;
+
+int ihex_open(ihex_reader *rd, const char *fname);
+int ihex_read(ihex_reader *rd, ihex_record *rec);
+void ihex_close(ihex_reader *rd);
+
+void ihex_writer_init(ihex_writer *w, FILE *fh);
+int ihex_write_record(FILE *fh, int type, unsigned address, const unsigned char *data, int len);
+int ihex_write_data(ihex_writer *w, unsigned address, const unsigned char *data, int len);
+int ihex_write_end(ihex_writer *w);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+  Intel HEX codec benchmark
+
+  writes a random image as a hex file, reads it back with ihex_read() and with the
+  sscanf() per byte decoding hexmerge and avrboot used before, checks and times all three
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "ihex.h"
+
+#define DEFAULT_SIZE 0x100000							// 1MB of flash, about 2.9MB of hex
+
+unsigned char *image;
+unsigned char *check;
+
+static long elapsed_us(struct timeval *t0)
+{
+	struct timeval t1;
+
+	gettimeofday(&t1, NULL);
+	return(((t1.tv_sec - t0->tv_sec) * 1000000L) + (t1.tv_usec - t0->tv_usec));
+}
+
+// the old way - memcpy 2 characters out and sscanf("%x") each byte, checksum pass then data pass
+static int sscanf_read(char *fname, unsigned char *dst, int size)
+{
+	int x, y, nr, chk, adr, segment;
+	FILE *fh;
+	char buf[1024+2];
+	char data[8];
+	int vlen, vaddr, vrectype, vchksum;
+
+	nr = 0; segment = 0;
+	fh = fopen(fname, "r");
+	if (!fh) return(-1);
+	while (fgets(buf, 1024, fh)) {
+		if ((buf[0] != ':') || (strlen(buf) < 11)) continue;
+		memset(data, 0, 8); memcpy(data, &buf[1], 2); sscanf(data, "%x", &vlen);
+		memset(data, 0, 8); memcpy(data, &buf[3], 4); sscanf(data, "%x", &vaddr);
+		memset(data, 0, 8); memcpy(data, &buf[7], 2); sscanf(data, "%x", &vrectype);
+		memset(data, 0, 8); memcpy(data, &buf[(2 * vlen) + 9], 2);
+		vchksum = -1;
+		sscanf(data, "%x", &vchksum);
+		chk = 0;
+		for (x = 0; x < (vlen + 4); x++) {
+			memset(data, 0, 8);
+			memcpy(data, &buf[(2 * x) + 1], 2);
+			y = -1;
+			sscanf(data, "%x", &y);
+			if (y >= 0) chk = (chk + y) & 0xff;
+		}
+		if (((0 - chk) & 0xff) != vchksum) continue;
+		if (vrectype == 0) {
+			adr = segment + vaddr;
+			for (x = 0; x < vlen; x++) {
+				memset(data, 0, 8);
+				memcpy(data, &buf[(2 * x) + 9], 2);
+				y = -1;
+				sscanf(data, "%x", &y);
+				if ((y >= 0) && (adr < size)) dst[adr] = y;
+				adr++;
+			}
+			nr++;
+		}
+		else if (vrectype == 1) break;
+		else if (vrectype == 2) {
+			memset(data, 0, 8); memcpy(data, &buf[9], 4);
+			if (sscanf(data, "%x", &y) == 1) segment = y << 4;
+		}
+	}
+	fclose(fh);
+	return(nr);
+}
+
+int main(int argc, char *argv[])
+{
+	int x, nr, size;
+	long t, hexsize;
+	char fname[64];
+	FILE *fh;
+	ihex_writer w;
+	ihex_reader rd;
+	ihex_record rec;
+	struct timeval t0;
+
+	size = DEFAULT_SIZE;
+	if (argc > 1) size = strtol(argv[1], NULL, 0) & ~15;
+	if ((size <= 0) || (size > DEFAULT_SIZE)) {
+		fprintf(stderr, "usage: ihexbench [bytes] (up to 0x%x, segment records only reach 1MB)\n", DEFAULT_SIZE);
+		return(1);
+	}
+	image = malloc(size);
+	check = malloc(size);
+	srand(1);
+	for (x = 0; x < size; x++) image[x] = rand();
+	snprintf(fname, sizeof(fname), "/tmp/ihexbench.%d.hex", (int)getpid());
+
+	// write
+	fh = fopen(fname, "w");
+	if (!fh) {
+		perror(fname);
+		return(1);
+	}
+	gettimeofday(&t0, NULL);
+	ihex_writer_init(&w, fh);
+	for (x = 0; x < size; x += 16) ihex_write_data(&w, x, image + x, 16);
+	ihex_write_end(&w);
+	fflush(fh);
+	t = elapsed_us(&t0);
+	hexsize = ftell(fh);
+	fclose(fh);
+	printf("%d bytes of flash, %ld bytes of hex\n", size, hexsize);
+	printf("ihex_write_data() %6ld mS %7.1f MB/s of hex\n", t / 1000, (double)hexsize / t);
+
+	// read with the codec
+	memset(check, 0xff, size);
+	gettimeofday(&t0, NULL);
+	if (ihex_open(&rd, fname)) {
+		fprintf(stderr, "%s\n", rd.err);
+		return(1);
+	}
+	nr = 0;
+	while ((x = ihex_read(&rd, &rec)) > 0) {
+		if ((rec.address + rec.len) <= size) memcpy(check + rec.address, rec.data, rec.len);
+		nr++;
+	}
+	ihex_close(&rd);
+	t = elapsed_us(&t0);
+	if (x < 0) {
+		fprintf(stderr, "%s\n", rd.err);
+		return(1);
+	}
+	printf("ihex_read()       %6ld mS %7.1f MB/s of hex, %d records %s\n", t / 1000, (double)hexsize / t, nr,
+		memcmp(image, check, size) ? "MISMATCH" : "ok");
+	x = memcmp(image, check, size);
+
+	// read the old way
+	memset(check, 0xff, size);
+	gettimeofday(&t0, NULL);
+	nr = sscanf_read(fname, check, size);
+	t = elapsed_us(&t0);
+	printf("sscanf() per byte %6ld mS %7.1f MB/s of hex, %d records %s\n", t / 1000, (double)hexsize / t, nr,
+		memcmp(image, check, size) ? "MISMATCH" : "ok");
+
+	unlink(fname);
+	return(x ? 1 : 0);
+}
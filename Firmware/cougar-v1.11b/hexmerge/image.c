@@ -0,0 +1,217 @@
+/*
+  Sparse flash image (used by hexmerge and avrboot)
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ihex.h"
+#include "image.h"
+
+#define PAGE_BASE(a) ((a) & ~(IMG_PAGE_SIZE - 1))
+
+static unsigned short crc_update(unsigned short crc, unsigned char data)
+{
+	data ^= crc & 0xff;
+	data ^= data << 4;
+	return ((((unsigned short)data << 8) | (crc >> 8)) ^ (unsigned char)(data >> 4)
+		^ ((unsigned short)data << 3));
+}
+
+void img_init(img_map *m)
+{
+	memset(m, 0, sizeof(img_map));
+}
+
+void img_free(img_map *m)
+{
+	int x;
+
+	for (x = 0; x < m->npages; x++) free(m->pages[x]);
+	free(m->pages);
+	img_init(m);
+}
+
+// index of the first page at or above address
+static int img_search(const img_map *m, unsigned address)
+{
+	int lo, hi, mid;
+
+	address = PAGE_BASE(address);
+	// hex files are mostly in order - try the end first
+	if (!m->npages || (m->pages[m->npages - 1]->address < address)) return(m->npages);
+	lo = 0; hi = m->npages - 1;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (m->pages[mid]->address < address) lo = mid + 1;
+		else hi = mid;
+	}
+	return(lo);
+}
+
+// page holding address (NULL if nothing there)
+img_page *img_find(const img_map *m, unsigned address)
+{
+	int x;
+
+	x = img_search(m, address);
+	if ((x < m->npages) && (m->pages[x]->address == PAGE_BASE(address))) return(m->pages[x]);
+	return(NULL);
+}
+
+static img_page *img_add(img_map *m, unsigned address)
+{
+	int x;
+	img_page *p;
+
+	x = img_search(m, address);
+	if ((x < m->npages) && (m->pages[x]->address == PAGE_BASE(address))) return(m->pages[x]);
+	if (m->npages >= m->size) {
+		m->size = m->size ? (m->size * 2) : 64;
+		m->pages = realloc(m->pages, m->size * sizeof(img_page *));
+		if (!m->pages) {
+			fprintf(stderr, "img_add() out of memory\n");
+			exit(1);
+		}
+	}
+	p = malloc(sizeof(img_page));
+	if (!p) {
+		fprintf(stderr, "img_add() out of memory\n");
+		exit(1);
+	}
+	p->address = PAGE_BASE(address);
+	p->count = 0;
+	memset(p->data, 0xff, IMG_PAGE_SIZE);
+	memset(p->valid, 0, sizeof(p->valid));
+	memmove(&m->pages[x + 1], &m->pages[x], (m->npages - x) * sizeof(img_page *));
+	m->pages[x] = p;
+	m->npages++;
+	return(p);
+}
+
+// put len bytes at address, returns number of bytes that already had data (they are overwritten)
+int img_write(img_map *m, unsigned address, const unsigned char *data, int len)
+{
+	int x, i, overlap;
+	img_page *p;
+
+	overlap = 0; p = NULL;
+	if (len <= 0) return(0);
+	for (x = 0; x < len; x++, address++) {
+		if (!p || (PAGE_BASE(address) != p->address)) p = img_add(m, address);
+		i = address - p->address;
+		if (p->valid[i >> 3] & (1 << (i & 7))) overlap++;
+		else {
+			p->valid[i >> 3] |= 1 << (i & 7);
+			p->count++;
+		}
+		p->data[i] = data[x];
+	}
+	address -= len;
+	if (!m->hi || (address < m->lo)) m->lo = address;
+	if ((address + len) > m->hi) m->hi = address + len;
+	return(overlap);
+}
+
+// copy len bytes from address (0xff where there is no data), returns number of bytes with data
+int img_read(const img_map *m, unsigned address, unsigned char *buf, int len)
+{
+	int n, i, x, rv;
+	img_page *p;
+
+	rv = 0;
+	while (len > 0) {
+		i = address - PAGE_BASE(address);
+		n = IMG_PAGE_SIZE - i;
+		if (n > len) n = len;
+		p = img_find(m, address);
+		if (p) {
+			memcpy(buf, &p->data[i], n);
+			if (p->count == IMG_PAGE_SIZE) rv += n;
+			else for (x = i; x < (i + n); x++) if (p->valid[x >> 3] & (1 << (x & 7))) rv++;
+		}
+		else memset(buf, 0xff, n);
+		buf += n; address += n; len -= n;
+	}
+	return(rv);
+}
+
+// find the first run of bytes with data at or after *start, returns 0 if there is none
+int img_next_range(const img_map *m, unsigned *start, unsigned *end)
+{
+	int x, i;
+	unsigned a;
+	img_page *p;
+
+	a = *start;
+	for (x = img_search(m, a); x < m->npages; x++) {
+		p = m->pages[x];
+		if (a < p->address) a = p->address;
+		for (i = a - p->address; i < IMG_PAGE_SIZE; i++) {
+			if (p->valid[i >> 3] & (1 << (i & 7))) break;
+		}
+		if (i >= IMG_PAGE_SIZE) continue;
+		*start = p->address + i;
+		// run goes on into the following pages while they carry on without a gap
+		while (1) {
+			while ((i < IMG_PAGE_SIZE) && (p->valid[i >> 3] & (1 << (i & 7)))) i++;
+			if ((i < IMG_PAGE_SIZE) || (++x >= m->npages) || (m->pages[x]->address != (p->address + IMG_PAGE_SIZE))
+				|| !(m->pages[x]->valid[0] & 1)) break;
+			p = m->pages[x];
+			i = 0;
+		}
+		*end = p->address + i;
+		return(1);
+	}
+	return(0);
+}
+
+// ccitt CRC of start to end (0xff where there is no data, like erased flash)
+unsigned short img_crc(const img_map *m, unsigned start, unsigned end)
+{
+	int x;
+	unsigned char buf[IMG_PAGE_SIZE];
+	unsigned short crc;
+	unsigned n;
+
+	crc = 0xffff;
+	while (start < end) {
+		n = IMG_PAGE_SIZE - (start - PAGE_BASE(start));
+		if (n > (end - start)) n = end - start;
+		img_read(m, start, buf, n);
+		for (x = 0; x < n; x++) crc = crc_update(crc, buf[x]);
+		start += n;
+	}
+	return(crc);
+}
+
+// add intel hex file to the image, lo/hi get the span of this file
+// overlap: 1 - data already in the image is an error (returns -2), 0 - it is overwritten
+// returns bytes read or -1
+int img_load_ihex(img_map *m, const char *fname, int overlap, unsigned *lo, unsigned *hi)
+{
+	int x, nr;
+	ihex_reader rd;
+	ihex_record rec;
+
+	nr = 0; *lo = 0; *hi = 0;
+	if (ihex_open(&rd, fname)) {
+		fprintf(stderr, "%s\n", rd.err);
+		return(-1);
+	}
+	while ((x = ihex_read(&rd, &rec)) > 0) {
+		if (!rec.len) continue;
+		if (img_write(m, rec.address, rec.data, rec.len) && overlap) {
+			x = -2;
+			break;
+		}
+		if (!nr || (rec.address < *lo)) *lo = rec.address;
+		if ((rec.address + rec.len) > *hi) *hi = rec.address + rec.len;
+		nr += rec.len;
+	}
+	ihex_close(&rd);
+	if (x == -1) fprintf(stderr, "%s\n", rd.err);
+	if (x < 0) return(x);
+	return(nr);
+}
@@ -0,0 +1,37 @@
+/*
+  Sparse flash image (used by hexmerge and avrboot)
+
+  only pages that have data are allocated, each with a bitmap of the bytes the hex
+  file(s) gave, pages are kept sorted so ranges with data are walked in address order
+*/
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#define IMG_PAGE_SIZE 256								// multiple of every SPM page size
+
+typedef struct {
+	unsigned address;									// of data[0]
+	int count;											// bytes with data
+	unsigned char data[IMG_PAGE_SIZE];					// 0xff where there is no data
+	unsigned char valid[IMG_PAGE_SIZE / 8];				// bit set if byte has data
+} img_page;
+
+typedef struct {
+	img_page **pages;									// sorted by address
+	int npages;
+	int size;											// pages allocated
+	unsigned lo;										// first byte with data
+	unsigned hi;										// last byte with data + 1 (0 if empty)
+} img_map;
+
+void img_init(img_map *m);
+void img_free(img_map *m);
+img_page *img_find(const img_map *m, unsigned address);
+int img_write(img_map *m, unsigned address, const unsigned char *data, int len);
+int img_read(const img_map *m, unsigned address, unsigned char *buf, int len);
+int img_next_range(const img_map *m, unsigned *start, unsigned *end);
+unsigned short img_crc(const img_map *m, unsigned start, unsigned end);
+int img_load_ihex(img_map *m, const char *fname, int overlap, unsigned *lo, unsigned *hi);
+
+#endif
@@ -0,0 +1,572 @@
+/*
+  Closed loop simulation of the cougar PI loop and gain set switching
+
+  The controller part is a copy of pi_loop() from cougar.c (same fixed point math,
+  4KHz PI loop, 1KHz throttle gain and ramp rate logic), AVR int is 16 bits so
+  short is used where the firmware uses int.
+  The plant is a series wound DC motor driving the vehicle, with the LEM current
+  sensor and the 10 bit ADC in front of the PI loop.
+
+  Each run drives a throttle profile and looks at every gain set switch,
+  current_fb must not leave the current_ref envelope by more than SPIKE_LIMIT
+  counts in the SPIKE_WINDOW after the switch.
+  The last run uses a positional PI with the error sum kept apart from Ki (what we
+  would get without the velocity form) to show what a bump looks like, it is
+  reported but not checked.
+
+  The gain schedule study holds the motor at a range of speeds and steps
+  current_ref around an operating point. It finds the single Kp/Ki pair with the
+  lowest tracking error over the tuning profiles, then tunes a gain schedule
+  ("gs-kpN", "gs-kiN") on the same profiles starting from that pair. A schedule
+  change is only taken if it lowers the error without making any speed band
+  (low, mid, high rad/s) of any profile worse than the single pair. The check is
+  on held out profiles the tuning never saw (speeds in between, other loads,
+  current_ref steps and step rates), where the schedule must not track worse than
+  the single pair in any speed band of any profile.
+
+  usage: pisim [-t trace.csv]
+  exit status is 0 if all checked runs pass
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#define TICK 250e-6						// PI loop period (4KHz)
+#define SUBSTEPS 25						// plant integration steps per PI loop
+#define SIM_TIME 30.0					// seconds per run
+
+#define SPIKE_LIMIT 10					// current_fb counts (about 10 amps)
+#define SPIKE_WINDOW 40					// PI loops (10mS) checked after a switch
+
+#define GAIN_SETS 2
+#define GAIN_SWITCH_HYST 8				// same as cougar.h
+#define GS_POINTS 5						// same as cougar.h
+#define GS_SHIFT 7						// same as cougar.h
+#define MAX_CURRENT_REF 511
+
+// plant
+#define V_BAT 144.0						// battery volts
+#define R_MOTOR 0.05					// armature + field + wiring ohms
+#define L_MOTOR 0.5e-3					// henries
+#define K_MOTOR 0.002					// series motor, back EMF = K * w * i, torque = K * i * i
+#define J_VEHICLE 5.6					// vehicle inertia seen by the motor (kg m^2)
+#define VREF 512						// current sensor zero (ADC counts)
+
+typedef struct {
+	int Kp, Ki;
+	unsigned throttle_pos_gain, throttle_pwm_gain;
+	int current_ramp_rate;
+} gain_config_type;
+
+// firmware gain_set_type
+typedef struct {
+	int32_t K1, K2;
+	uint16_t throttle_pos_gain, throttle_pwm_gain;
+	int16_t current_ramp_rate;
+} gain_set_type;
+
+// launch and cruise gains
+gain_config_type gain_config[GAIN_SETS] = {
+	{2, 160, 8, 0, 6},
+	{8, 40, 8, 2, 3}
+};
+
+#define MODE_FIXED 0					// gain set 1 only
+#define MODE_AUTO 1						// switch on ocr1a_lpf
+#define MODE_TOGGLE 2					// "gain-set" command every TOGGLE_TIME
+#define MODE_TRACK 3					// current_ref set by the test, no throttle logic
+#define TOGGLE_TIME 100					// PI loops (25mS)
+
+// gain schedule study
+#define TRACK_SPEEDS 9					// most speeds in a profile
+#define TRACK_SETTLE 400				// PI loops before tracking error is measured
+#define TRACK_TIME 2000					// PI loops tracking error is measured over
+#define SPEED_BANDS 3					// tracking error is checked per band of 100 rad/s (the last is open)
+
+int grid_Kp[] = {1, 2, 4, 8, 16, 32, 48, 64, 96, 128, 192, 256, 384, 500};
+int grid_Ki[] = {10, 20, 40, 80, 160, 320, 500};
+
+#define GRID_KP (sizeof(grid_Kp) / sizeof(int))
+#define GRID_KI (sizeof(grid_Ki) / sizeof(int))
+
+typedef struct {
+	const char *name;
+	int mode;
+	int positional;						// 1 for positional PI (not bumpless, not checked)
+	unsigned gain_switch_lpf;
+} run_type;
+
+run_type runs[] = {
+	{"gain set 1 only", MODE_FIXED, 0, 0},
+	{"auto switch, gain-sw-lpf 200", MODE_AUTO, 0, 200},
+	{"gain-set toggled every 25mS", MODE_TOGGLE, 0, 200},
+	{"positional PI, auto switch", MODE_AUTO, 1, 200},
+};
+
+#define NUM_RUNS (sizeof(runs) / sizeof(run_type))
+
+typedef struct {
+	const char *name;
+	int speeds;							// motor held at first_speed, first_speed + speed_step ..
+	double first_speed, speed_step;		// rad/s
+	double load;						// operating point, part of the current the battery can push
+	int step;							// current_ref steps +/- this around the operating point
+	int period;							// PI loops per current_ref step period
+} track_profile_type;
+
+// schedule and single pair are tuned on these (0 .. 320 rad/s, 25Hz current_ref steps)
+track_profile_type tune_profiles[] = {
+	{"tuning, light", 9, 0.0, 40.0, 0.3, 20, 160},
+	{"tuning, medium", 9, 0.0, 40.0, 0.6, 40, 160},
+	{"tuning, heavy", 9, 0.0, 40.0, 0.9, 60, 160},
+};
+
+// and scored on these (20 .. 300 rad/s, loads and steps in between, other step rates)
+track_profile_type test_profiles[] = {
+	{"held out, 40Hz", 8, 20.0, 40.0, 0.45, 30, 100},
+	{"held out, 16Hz", 8, 20.0, 40.0, 0.75, 50, 250},
+};
+
+#define NUM_TUNE (sizeof(tune_profiles) / sizeof(track_profile_type))
+#define NUM_TEST (sizeof(test_profiles) / sizeof(track_profile_type))
+
+// controller state (same names as cougar.c)
+gain_set_type gain_set[GAIN_SETS];
+gain_set_type *gains;
+int32_t error_new, error_old, pwm, error_sum;
+int32_t sched_K1, sched_K2;
+int gain_sched, gs_Kp[GS_POINTS], gs_Ki[GS_POINTS];
+uint32_t ocr1a_lpf_32;
+uint16_t ocr1a_lpf, ocr1a;
+int16_t throttle_ref, current_ref, current_fb;
+unsigned char throttle_counter;
+
+// plant state
+double amps, w;
+int hold_speed;							// 1 to keep w where it is
+
+FILE *trace = NULL;
+
+void calc_gain_sets(void)
+{
+	int n;
+
+	for (n = 0; n < GAIN_SETS; n++) {
+		gain_set[n].K1 = (int32_t)gain_config[n].Kp << 10;
+		gain_set[n].K2 = (int32_t)gain_config[n].Ki - gain_set[n].K1;
+		gain_set[n].throttle_pos_gain = gain_config[n].throttle_pos_gain;
+		gain_set[n].throttle_pwm_gain = gain_config[n].throttle_pwm_gain;
+		gain_set[n].current_ramp_rate = gain_config[n].current_ramp_rate;
+	}
+}
+
+// throttle pedal (0 to 511) at time t
+int16_t throttle_profile(double t)
+{
+	if (t < 12.0) return(511);			// launch, full throttle
+	if (t < 15.0) return(150);			// back off
+	if (t < 22.0) return(511);			// full throttle again at speed
+	if (t < 24.0) return(0);			// lift off (current_ref 0 resets PI)
+	return(300);						// cruise
+}
+
+// one PI loop, copy of pi_loop()
+void pi_loop(run_type *run, uint16_t raw_current_fb)
+{
+	uint16_t loc_current_fb, loc_throttle, uv1, uv2;
+	uint32_t luv1;
+	int16_t i;
+	gain_set_type *g;
+
+	g = gains;
+	if (raw_current_fb < VREF) loc_current_fb = 0;
+	else loc_current_fb = raw_current_fb - VREF;
+	current_fb = (loc_current_fb * 19) >> 3;
+	error_new = current_ref - current_fb;
+	if (current_ref == 0) {
+		pwm = 0;
+		error_sum = 0;
+	}
+	else if (run->positional) {
+		// positional form, pwm = Kp * error + Ki * sum of errors
+		// a new Ki rescales the whole sum - that is the bump
+		error_sum += error_old;
+		if (error_sum * (g->K2 + g->K1) > (510L << 16)) error_sum = (510L << 16) / (g->K2 + g->K1);
+		else if (error_sum < 0L) error_sum = 0L;
+		pwm = (error_sum * (g->K2 + g->K1)) + (g->K1 * error_new);
+	}
+	else if (gain_sched) {
+		pwm += (sched_K1 * error_new) + (sched_K2 * error_old);
+	}
+	else {
+		pwm += (g->K1 * error_new) + (g->K2 * error_old);
+	}
+	error_old = error_new;
+	if (pwm > (510L << 16)) pwm = (510L << 16);
+	else if (pwm < 0L) pwm = 0L;
+	uv1 = pwm >> 16;
+	if (pwm & 0x8000) uv1++;
+	ocr1a = uv1;
+
+	luv1 = (uint32_t)ocr1a << 16;
+	ocr1a_lpf_32 = ((ocr1a_lpf_32 * 127) + luv1) >> 7;	// pwm_filter 0
+	ocr1a_lpf = ocr1a_lpf_32 >> 16;
+
+	throttle_counter++;
+	if (run->mode == MODE_TRACK) {
+		// current_ref comes from the test
+	}
+	else if ((throttle_counter & 0x03) == 0x01) {
+		if (run->mode == MODE_AUTO) {
+			if (run->gain_switch_lpf == 0) g = &gain_set[0];
+			else if (ocr1a_lpf > run->gain_switch_lpf + GAIN_SWITCH_HYST) g = &gain_set[1];
+			else if (ocr1a_lpf + GAIN_SWITCH_HYST < run->gain_switch_lpf) g = &gain_set[0];
+			gains = g;
+		}
+		uv1 = ((uint16_t)throttle_ref * g->throttle_pos_gain) >> 3;
+		uv2 = (ocr1a_lpf * g->throttle_pwm_gain) >> 3;
+		if (uv1 > uv2) loc_throttle = uv1 - uv2;
+		else loc_throttle = 0;
+		if (loc_throttle > MAX_CURRENT_REF) i = (MAX_CURRENT_REF - current_ref);
+		else i = (int16_t)loc_throttle - current_ref;
+		if (i > g->current_ramp_rate) i = g->current_ramp_rate;
+		else if (i < -g->current_ramp_rate) i = -g->current_ramp_rate;
+		current_ref += i;
+	}
+	if ((throttle_counter & 0x03) == 0x02) {
+		uv1 = ocr1a_lpf >> GS_SHIFT;
+		if (uv1 > GS_POINTS - 2) uv1 = GS_POINTS - 2;
+		i = ocr1a_lpf - (uv1 << GS_SHIFT);
+		sched_K1 = ((int32_t)gs_Kp[uv1] << 10) +
+			((int32_t)(gs_Kp[uv1 + 1] - gs_Kp[uv1]) * i * (1 << (10 - GS_SHIFT)));
+		sched_K2 = (int32_t)gs_Ki[uv1] +
+			(((int32_t)(gs_Ki[uv1 + 1] - gs_Ki[uv1]) * i) >> GS_SHIFT) - sched_K1;
+	}
+}
+
+// advance motor and vehicle by one PI loop, return ADC reading of current sensor
+uint16_t plant(void)
+{
+	double v, di, t_load;
+	int n, adc;
+
+	v = V_BAT * (double)ocr1a / 511.0;
+	for (n = 0; n < SUBSTEPS; n++) {
+		di = (v - (R_MOTOR + (K_MOTOR * w)) * amps) / L_MOTOR;
+		amps += di * (TICK / SUBSTEPS);
+		if (amps < 0.0) amps = 0.0;		// freewheel diode
+		if (hold_speed) continue;
+		t_load = 5.0 + (0.0005 * w * w);
+		w += ((K_MOTOR * amps * amps) - t_load) / J_VEHICLE * (TICK / SUBSTEPS);
+		if (w < 0.0) w = 0.0;
+	}
+	// LEM 300 gives 213 counts for 500 amps
+	adc = VREF + (int)(amps * 213.0 / 500.0);
+	if (adc > 1023) adc = 1023;
+	return(adc);
+}
+
+void reset_controller(void)
+{
+	calc_gain_sets();
+	gains = &gain_set[0];
+	error_new = error_old = pwm = error_sum = 0;
+	// schedule at ocr1a_lpf 0 - a run must not start with two PI loops of zero gain
+	sched_K1 = (int32_t)gs_Kp[0] << 10;
+	sched_K2 = (int32_t)gs_Ki[0] - sched_K1;
+	ocr1a_lpf_32 = 0; ocr1a_lpf = ocr1a = 0;
+	throttle_ref = current_ref = current_fb = 0;
+	throttle_counter = 0;
+	amps = 0.0;
+}
+
+// return 1 if run passes
+int simulate(run_type *run)
+{
+	long tick, ticks, last_switch;
+	int switches, spike, worst_spike, step, worst_step, worst_step_switch;
+	double worst_spike_time;
+	int16_t ref_max, ref_min, cfb_before, last_ocr1a;
+	uint16_t raw;
+	gain_set_type *prev;
+
+	reset_controller();
+	gain_sched = 0;
+	hold_speed = 0;
+	w = 0.0;
+
+	switches = worst_spike = worst_step = worst_step_switch = 0;
+	worst_spike_time = 0.0;
+	last_switch = -SPIKE_WINDOW - 1;
+	ref_max = ref_min = cfb_before = 0;
+	last_ocr1a = 0;
+	raw = VREF;
+	ticks = (long)(SIM_TIME / TICK);
+	for (tick = 0; tick < ticks; tick++) {
+		throttle_ref = throttle_profile(tick * TICK);
+		prev = gains;
+		if ((run->mode == MODE_TOGGLE) && (tick % TOGGLE_TIME) == (TOGGLE_TIME - 1)) {
+			gains = (gains == &gain_set[0]) ? &gain_set[1] : &gain_set[0];
+		}
+		pi_loop(run, raw);
+		raw = plant();
+		step = abs((int)ocr1a - (int)last_ocr1a);
+		last_ocr1a = ocr1a;
+		if (step > worst_step) worst_step = step;
+		if (gains != prev) {
+			// switch - from a command before this PI loop, or automatic (used from the next one on)
+			switches++;
+			last_switch = tick;
+			cfb_before = current_fb;
+			ref_max = ref_min = current_ref;
+		}
+		if (tick - last_switch <= SPIKE_WINDOW) {
+			// current_fb must stay between current_ref (or where it was) +/- SPIKE_LIMIT
+			if (tick != last_switch && step > worst_step_switch) worst_step_switch = step;
+			if (current_ref > ref_max) ref_max = current_ref;
+			if (current_ref < ref_min) ref_min = current_ref;
+			spike = 0;
+			if (current_fb > ref_max && current_fb > cfb_before)
+				spike = current_fb - ((ref_max > cfb_before) ? ref_max : cfb_before);
+			else if (current_fb < ref_min && current_fb < cfb_before)
+				spike = ((ref_min < cfb_before) ? ref_min : cfb_before) - current_fb;
+			if (spike > worst_spike) {
+				worst_spike = spike;
+				worst_spike_time = tick * TICK;
+			}
+		}
+		if (trace) {
+			fprintf(trace, "\"%s\",%.4f,%d,%d,%d,%d,%d,%.1f\n", run->name, tick * TICK, throttle_ref,
+				current_ref, current_fb, ocr1a, (int)(gains - gain_set) + 1, w);
+		}
+	}
+	printf("%-30s %5d %5d %7.3f %11d %8d  %s\n", run->name, switches, worst_spike, worst_spike_time,
+		worst_step_switch, worst_step,
+		run->positional ? "(reference)" : (worst_spike <= SPIKE_LIMIT ? "PASS" : "FAIL"));
+	if (run->positional) return(1);
+	return(worst_spike <= SPIKE_LIMIT);
+}
+
+// mean |current_ref - current_fb| with the motor held at speed (gain set 1 or gain schedule)
+// also returns mean ocr1a_lpf in *lpf
+double track_error(track_profile_type *prof, double speed, double *lpf)
+{
+	run_type run = {"track", MODE_TRACK, 0, 0};
+	long tick, err_sum, lpf_sum;
+	int16_t base;
+	uint16_t raw;
+
+	reset_controller();
+	hold_speed = 1;
+	w = speed;
+	// operating point at prof->load of the current the battery can push at this speed (max 200 counts)
+	base = prof->load * (V_BAT / (R_MOTOR + (K_MOTOR * speed))) * 505.0 / 500.0;
+	if (base > 200) base = 200;
+	err_sum = lpf_sum = 0;
+	raw = VREF;
+	for (tick = 0; tick < TRACK_SETTLE + TRACK_TIME; tick++) {
+		if (tick < TRACK_SETTLE) current_ref = base;
+		else current_ref = ((tick / (prof->period / 2)) & 0x01) ? base + prof->step : base - prof->step;
+		pi_loop(&run, raw);
+		raw = plant();
+		if (tick >= TRACK_SETTLE) {
+			err_sum += abs(current_ref - current_fb);
+			lpf_sum += ocr1a_lpf;
+		}
+	}
+	*lpf = (double)lpf_sum / TRACK_TIME;
+	return((double)err_sum / TRACK_TIME);
+}
+
+// sum of tracking error over the speeds of a profile with the gain schedule (sched 1) or
+// gain set 1, ocr1a_lpf and errors in lpf[], err[]
+double profile_error(track_profile_type *prof, int sched, double *lpf, double *err)
+{
+	double sum;
+	int s;
+
+	gain_sched = sched;
+	for (sum = 0.0, s = 0; s < prof->speeds; s++) {
+		err[s] = track_error(prof, prof->first_speed + (s * prof->speed_step), &lpf[s]);
+		sum += err[s];
+	}
+	gain_sched = 0;
+	return(sum);
+}
+
+// sum of tracking error over several profiles with the gain schedule (sched 1) or gain set 1
+double profiles_error(track_profile_type *prof, int n, int sched)
+{
+	double lpf[TRACK_SPEEDS], err[TRACK_SPEEDS], sum;
+	int x;
+
+	for (sum = 0.0, x = 0; x < n; x++) sum += profile_error(&prof[x], sched, lpf, err);
+	return(sum);
+}
+
+// sum of tracking error per speed band of each of several profiles (profile x band b in
+// band[(x * SPEED_BANDS) + b]), returns the total
+double bands_error(track_profile_type *prof, int n, int sched, double *band)
+{
+	double lpf[TRACK_SPEEDS], err[TRACK_SPEEDS], sum;
+	int x, s, b;
+
+	for (b = 0; b < n * SPEED_BANDS; b++) band[b] = 0.0;
+	for (sum = 0.0, x = 0; x < n; x++) {
+		sum += profile_error(&prof[x], sched, lpf, err);
+		for (s = 0; s < prof[x].speeds; s++) {
+			b = (prof[x].first_speed + (s * prof[x].speed_step)) / 100.0;
+			if (b >= SPEED_BANDS) b = SPEED_BANDS - 1;
+			band[(x * SPEED_BANDS) + b] += err[s];
+		}
+	}
+	return(sum);
+}
+
+// return 1 if none of the n bands of sched[] is worse than the same band of single[]
+int bands_ok(int n, double *single, double *sched)
+{
+	int b;
+
+	for (b = 0; b < n; b++) {
+		if (sched[b] > single[b]) return(0);
+	}
+	return(1);
+}
+
+// tracking error per speed of a profile, single pair against gain schedule
+void print_profile(track_profile_type *prof)
+{
+	double lpf[TRACK_SPEEDS], single[TRACK_SPEEDS], sched[TRACK_SPEEDS], single_sum, sched_sum;
+	int s;
+
+	single_sum = profile_error(prof, 0, lpf, single);
+	sched_sum = profile_error(prof, 1, lpf, sched);
+	printf("\n%s: load %.0f%%, current_ref steps +/-%d counts at %dHz\n\n", prof->name, prof->load * 100.0,
+		prof->step, (int)(1.0 / (prof->period * TICK)));
+	printf("%6s %14s %6s %14s\n", "rad/s", "single err", "lpf", "schedule err");
+	for (s = 0; s < prof->speeds; s++) {
+		printf("%6.0f %14.2f %6.0f %14.2f\n", prof->first_speed + (s * prof->speed_step), single[s], lpf[s],
+			sched[s]);
+	}
+	printf("%6s %14.2f %6s %14.2f\n", "mean", single_sum / prof->speeds, "", sched_sum / prof->speeds);
+}
+
+// return 1 if gain schedule tracks no worse than the best single Kp/Ki pair in every speed band
+// of the held out profiles
+int gain_schedule_study(void)
+{
+	double sum, best_sum, sched_sum, single_band[NUM_TUNE * SPEED_BANDS], band[NUM_TUNE * SPEED_BANDS];
+	double test_single[NUM_TEST * SPEED_BANDS], test_sched[NUM_TEST * SPEED_BANDS];
+	int p, i, n, x, b, pass, single_kp, single_ki, kp, ki, ok;
+
+	// best single pair over the tuning profiles
+	single_kp = single_ki = 0;
+	best_sum = 1e9;
+	for (p = 0; p < GRID_KP; p++) {
+		for (i = 0; i < GRID_KI; i++) {
+			gain_config[0].Kp = grid_Kp[p];
+			gain_config[0].Ki = grid_Ki[i];
+			sum = profiles_error(tune_profiles, NUM_TUNE, 0);
+			if (sum < best_sum) {
+				best_sum = sum;
+				single_kp = p;
+				single_ki = i;
+			}
+		}
+	}
+	gain_config[0].Kp = grid_Kp[single_kp];
+	gain_config[0].Ki = grid_Ki[single_ki];
+	bands_error(tune_profiles, NUM_TUNE, 0, single_band);
+
+	// tune schedule one point at a time, starting with the best single pair at every point
+	// a change must lower the total without any speed band getting worse than the single pair
+	for (n = 0; n < GS_POINTS; n++) {
+		gs_Kp[n] = grid_Kp[single_kp];
+		gs_Ki[n] = grid_Ki[single_ki];
+	}
+	sched_sum = best_sum;
+	for (pass = 0; pass < 3; pass++) {
+		for (n = 0; n < GS_POINTS; n++) {
+			kp = gs_Kp[n];
+			for (p = 0; p < GRID_KP; p++) {
+				gs_Kp[n] = grid_Kp[p];
+				sum = bands_error(tune_profiles, NUM_TUNE, 1, band);
+				if ((sum < sched_sum) && bands_ok(NUM_TUNE * SPEED_BANDS, single_band, band)) {
+					sched_sum = sum;
+					kp = gs_Kp[n];
+				}
+			}
+			gs_Kp[n] = kp;
+			ki = gs_Ki[n];
+			for (i = 0; i < GRID_KI; i++) {
+				gs_Ki[n] = grid_Ki[i];
+				sum = bands_error(tune_profiles, NUM_TUNE, 1, band);
+				if ((sum < sched_sum) && bands_ok(NUM_TUNE * SPEED_BANDS, single_band, band)) {
+					sched_sum = sum;
+					ki = gs_Ki[n];
+				}
+			}
+			gs_Ki[n] = ki;
+		}
+	}
+
+	printf("\ngain schedule study, best single pair Kp=%d Ki=%d\n", grid_Kp[single_kp], grid_Ki[single_ki]);
+	for (x = 0; x < NUM_TUNE; x++) print_profile(&tune_profiles[x]);
+	printf("\n");
+	for (n = 0; n < GS_POINTS; n++) printf("gs-kp%d %d\ngs-ki%d %d\n", n, gs_Kp[n], n, gs_Ki[n]);
+	printf("gain-sched 1\n");
+
+	// score both on the held out profiles, per speed band
+	for (x = 0; x < NUM_TEST; x++) print_profile(&test_profiles[x]);
+	bands_error(test_profiles, NUM_TEST, 0, test_single);
+	bands_error(test_profiles, NUM_TEST, 1, test_sched);
+	ok = bands_ok(NUM_TEST * SPEED_BANDS, test_single, test_sched);
+	printf("\n%-16s %-10s %14s %14s\n", "", "rad/s", "single err", "schedule err");
+	for (x = 0; x < NUM_TEST; x++) {
+		for (b = 0; b < SPEED_BANDS; b++) {
+			n = (x * SPEED_BANDS) + b;
+			printf("%-16s ", test_profiles[x].name);
+			if (b == SPEED_BANDS - 1) printf("%3d+       ", b * 100);
+			else printf("%3d-%3d    ", b * 100, (b * 100) + 99);
+			printf("%14.2f %14.2f %s\n", test_single[n], test_sched[n], (test_sched[n] > test_single[n]) ? "worse" : "");
+		}
+	}
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return(ok);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned n;
+	int ok;
+
+	if ((argc == 3) && !strcmp(argv[1], "-t")) {
+		trace = fopen(argv[2], "w");
+		if (trace == NULL) {
+			perror(argv[2]);
+			return(2);
+		}
+		fprintf(trace, "run,time,throttle_ref,current_ref,current_fb,ocr1a,gain_set,w\n");
+	}
+	else if (argc != 1) {
+		fprintf(stderr, "usage: pisim [-t trace.csv]\n");
+		return(2);
+	}
+	printf("gain set 1: Kp=%d Ki=%d t_pos=%u t_pwm=%u c_rr=%d\n", gain_config[0].Kp, gain_config[0].Ki,
+		gain_config[0].throttle_pos_gain, gain_config[0].throttle_pwm_gain, gain_config[0].current_ramp_rate);
+	printf("gain set 2: Kp=%d Ki=%d t_pos=%u t_pwm=%u c_rr=%d\n", gain_config[1].Kp, gain_config[1].Ki,
+		gain_config[1].throttle_pos_gain, gain_config[1].throttle_pwm_gain, gain_config[1].current_ramp_rate);
+	printf("spike limit %d counts in %d mS after a switch\n\n", SPIKE_LIMIT, SPIKE_WINDOW / 4);
+	printf("%-30s %5s %5s %7s %11s %8s\n", "run", "sw", "spike", "at (s)", "pwm step@sw", "pwm step");
+	ok = 1;
+	for (n = 0; n < NUM_RUNS; n++) {
+		if (!simulate(&runs[n])) ok = 0;
+	}
+	if (!gain_schedule_study()) ok = 0;
+	if (trace) fclose(trace);
+	return(ok ? 0 : 1);
+}
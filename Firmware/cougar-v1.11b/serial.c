@@ -2,24 +2,15 @@
 serial port support for cougar.c
 */
 
-#ifdef __AVR_ATmega168__
-#define MEGA168
-#endif
-
 #include <avr/io.h>
 #include <avr/interrupt.h>
-#ifdef MEGA168
 #include <avr/iom168.h>
-#else
-#include <avr/iom8.h>
-#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "cougar.h"
 
-#ifdef MEGA168
 #define SIG_UART_RECV SIG_USART_RECV
 #define SIG_UART_DATA SIG_USART_DATA
 #define UDR UDR0
@@ -30,7 +21,6 @@ serial port support for cougar.c
 #define UDRIE UDRIE0
 #define UBRRL UBRR0L
 #define UBRRH UBRR0H
-#endif
 
 // UART (serial)
 typedef struct {
@@ -51,6 +41,7 @@ SIGNAL(SIG_UART_RECV)
 {
 	unsigned char c;
 	unsigned i;
+	LOAD_BEGIN();
 	
 	c = UDR;
 	i = uart.rxhead + 1;
@@ -60,12 +51,14 @@ SIGNAL(SIG_UART_RECV)
 		uart.rxbuf[uart.rxhead] = c;
 		uart.rxhead = i;
 	}
+	LOAD_END(LOAD_UART_RX);
 }
 
 /* uart UDR empty interrupt */
 SIGNAL(SIG_UART_DATA)
 {
 	unsigned i;
+	LOAD_BEGIN();
 	
 	i = uart.txtail;
 	if (i != uart.txhead) {
@@ -77,6 +70,7 @@ SIGNAL(SIG_UART_DATA)
 		// disable TX buffer empty interrupt
 		UCSRB = (1 << RXEN) | (1 << TXEN) | (1 << RXCIE);
 	}
+	LOAD_END(LOAD_UART_TX);
 }
 
 // get character from uart fifo, return -1 if fifo empty
@@ -137,10 +131,7 @@ void setup_uart(void)
 	ubrr = ((unsigned long)F_OSC / ((unsigned long)16 * (unsigned long)19200)) - 1;
 	UBRRL = ubrr & 0xff;
 	UBRRH = ubrr >> 8;
-	#ifdef MEGA168
+	UCSR0A = 0;								// normal speed (a hardware uart bootloader uses U2X0)
 	UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
-	#else
-	UCSRC = (PARITY_NONE << 4) | (BITS_8_1 << 1) | (1 << URSEL);
-	#endif
 	UCSRB = (1 << RXEN) | (1 << TXEN) | (1 << RXCIE);
 }